@@ -44,6 +44,7 @@ http://www.open-std.org/jtc1/sc22/wg21/docs/lwg-defects.html#69
 #include <cstring>
 #include <map>
 #include <iostream>
+#include <limits>
 #include <set>
 #include <stdexcept>
 #include <string>
@@ -82,6 +83,19 @@ enum
     SDAT_CHUNKSIZE = 16,
 };
 
+/**
+ * A type that represents the rank of a record value (smaller is better).
+ */
+typedef float rank_type;
+
+/**
+ * Reports the rank that is worse than any real rank.
+ */
+inline rank_type worst_rank()
+{
+    return std::numeric_limits<rank_type>::max();
+}
+
 /**
  * Attributes and operations for a double array (4 bytes/element).
  */
@@ -570,6 +584,15 @@ public:
         return m_offset;
     }
 
+    /**
+     * Obtains a read-only access to the current read position.
+     *  @return const char* The pointer to the current position.
+     */
+    inline const char *ptr() const
+    {
+        return reinterpret_cast<const char *>(&m_cont[m_offset]);
+    }
+
     /**
      * Counts the number of letters in the string from the current position.
      *  @return size_type   The number of letters.
@@ -696,6 +719,20 @@ public:
         m_offset += strlen() + 1;
         return *this;
     }
+    /**
+     * Gets a null-terminated string without copying it.
+     *  @param[out] str     The pointer to the string in the tail array.
+     *  @param[out] length  The length of the string.
+     *  @return itail&      The reference to this object.
+     */
+    inline itail &read_string(const char *&str, size_type &length)
+    {
+        str = ptr();
+        length = strlen();
+        m_offset += length + 1;
+        return *this;
+    }
+
     inline itail &operator>>(std::string &str)
     {
         str = reinterpret_cast<const char *>(&m_cont[m_offset]);
@@ -811,6 +848,11 @@ protected:
     uint8_t m_table[NUMCHARS];
     doublearray_type m_da;
     itail m_tail;
+    array<rank_type> m_rank;
+    array<uint32_t> m_topk_index;
+    uint32_t m_topk_n;
+    uint32_t m_topk_topn;
+    itail m_topk;
     size_type m_n;
 
 public:
@@ -820,6 +862,8 @@ public:
     trie()
     {
         m_block = NULL;
+        m_topk_n = 0;
+        m_topk_topn = 0;
 
         // Initialize the character table.
         for (int i = 0; i < NUMCHARS; ++i)
@@ -913,6 +957,23 @@ public:
     };
 
     bool getChildren(const char *key, std::vector<KeyValuePair> &vecResult, int nMaxCountNeeded)
+    {
+        never_stop stop;
+        return getChildren(key, vecResult, nMaxCountNeeded, stop);
+    }
+
+    /**
+     * Gets the records below a prefix in key order, until the stop
+     * predicate turns true.
+     *  @param  key             The prefix.
+     *  @param[out] vecResult   The vector receiving the records.
+     *  @param  nMaxCountNeeded The maximum number of records to get.
+     *  @param  stop            A callable returning \c true to stop early,
+     *                          called once per visited node.
+     *  @return bool            \c true if the prefix exists.
+     */
+    template <class stop_type>
+    bool getChildren(const char *key, std::vector<KeyValuePair> &vecResult, int nMaxCountNeeded, stop_type &stop)
     {
         if (nMaxCountNeeded <= 0)
         {
@@ -938,7 +999,7 @@ public:
                 --nMaxCountNeeded;
             }
             std::string strCurrentKey = key;
-            getChildrenRecursive(offset, vecResult, nMaxCountNeeded, strCurrentKey);
+            getChildrenRecursive(offset, vecResult, nMaxCountNeeded, strCurrentKey, stop);
             return true;
         }
         else
@@ -947,31 +1008,216 @@ public:
         }
     }
 
-protected:
-    size_type locate_ex(const char *key)
+    /**
+     * Enumerates the records below a prefix in best-first order.
+     *
+     *  Nodes are expanded from a priority queue ordered by the best rank of
+     *  their subtrees (the "RANK" chunk), so only the subtrees that can
+     *  still contribute to the result are visited. The collector decides
+     *  when to stop; it must implement:
+     *  - <tt>rank_type bound() const</tt>: the worst rank that is still
+     *    worth visiting (worst_rank() while the collector is not full);
+     *    a bound better than any rank ends the walk at once;
+     *  - <tt>void add(const value_type &value)</tt>: receives the value of
+     *    a leaf, leaves are visited in increasing order of their rank.
+     *
+     *  @param  key         The prefix.
+     *  @param  collector   The collector receiving the values.
+     *  @return bool        \c true if the prefix exists and the trie has
+     *                      subtree ranks; \c false otherwise.
+     */
+    template <class collector_type>
+    bool getTopChildren(const char *key, collector_type &collector)
     {
-        const char *p = key;
-        const char *last = key + strlen(key);
-        size_type offset = 0;
-        size_type cur = INITIAL_INDEX;
+        if (!m_rank)
+        {
+            return false;
+        }
+
+        size_type offset = locate_ex(key);
+        if (offset == INVALID_INDEX)
+        {
+            return false;
+        }
+        return getTopChildrenAt(offset, collector);
+    }
+
+    /**
+     * Enumerates the records below a node in best-first order.
+     *  @param  offset      The node, e.g., from locate_ex() or walk().
+     *  @param  collector   The collector receiving the values, see
+     *                      getTopChildren().
+     *  @return bool        \c true if the trie has subtree ranks;
+     *                      \c false otherwise.
+     */
+    template <class collector_type>
+    bool getTopChildrenAt(size_type offset, collector_type &collector)
+    {
+        if (!m_rank || offset == INVALID_INDEX)
+        {
+            return false;
+        }
 
         itail tmp_itail(m_tail);
+        value_type value;
+        std::vector<rank_node> heap;
+        heap.reserve(NUMCHARS);
+        heap.push_back(rank_node(m_rank[offset], offset));
 
-        for (; *p;)
+        while (!heap.empty())
         {
-            base_type base = get_base(cur);
-            if (base < 0)
+            std::pop_heap(heap.begin(), heap.end());
+            rank_node top = heap.back();
+            heap.pop_back();
+
+            // Nothing left in the queue can improve the collector.
+            if (collector.bound() < top.rank)
             {
-                // The element #cur is a leaf node.
-                offset = (size_type) - base;
                 break;
             }
 
-            // If the pointer exceeded the end of string.
-            if (last < p)
+            base_type base = get_base(top.index);
+            if (base < 0)
             {
-                // The key string couldn't reach a leaf node.
-                return false;
+                // Skip the key postfix and read the value of the leaf.
+                tmp_itail.seekg((size_type) - base);
+                tmp_itail.seekg((size_type) - base + tmp_itail.strlen() + 1);
+                tmp_itail >> value;
+                collector.add(value);
+                continue;
+            }
+
+            // Push every child node whose subtree may still be useful.
+            for (size_type c = 0; c < NUMCHARS; ++c)
+            {
+                size_type next = (size_type)base + c + 1;
+                if (m_da.size() <= next)
+                {
+                    break;
+                }
+                if (get_check(next) != (check_type)c || get_base(next) == 0)
+                {
+                    continue;
+                }
+                if (collector.bound() < m_rank[next])
+                {
+                    continue;
+                }
+                heap.push_back(rank_node(m_rank[next], next));
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Gets the value precomputed for a node (the "TOPK" chunk).
+     *  @param  index       The index of the node, e.g., from locate_ex().
+     *  @param[out] value   The reference to a variable that receives the
+     *                      value of the node.
+     *  @return bool        \c true if the node has a precomputed value;
+     *                      \c false otherwise.
+     */
+    bool getTopValue(size_type index, value_type &value) const
+    {
+        if (m_topk_n == 0)
+        {
+            return false;
+        }
+        const uint32_t *first = &m_topk_index[0];
+        const uint32_t *last = first + 2 * m_topk_n;
+
+        // Binary search in the (index, offset) pairs sorted by index.
+        while (first < last)
+        {
+            const uint32_t *mid = first + 2 * ((last - first) / 4);
+            if (mid[0] < index)
+            {
+                first = mid + 2;
+            }
+            else
+            {
+                last = mid;
+            }
+        }
+        if (first == &m_topk_index[0] + 2 * m_topk_n || first[0] != index)
+        {
+            return false;
+        }
+
+        itail tmp_itail(m_topk);
+        tmp_itail.seekg(first[1]);
+        tmp_itail >> value;
+        return true;
+    }
+
+    /**
+     * Reports the number of items kept for each node in the "TOPK" chunk.
+     *  @return size_type   The maximum number of items of a precomputed
+     *                      value; zero if the chunk does not exist.
+     */
+    size_type topn() const
+    {
+        return m_topk_topn;
+    }
+
+    /**
+     * Reports whether the trie carries the best rank of every subtree.
+     *  @return bool        \c true if a "RANK" chunk was loaded.
+     */
+    bool ranked() const
+    {
+        return m_rank;
+    }
+
+    /**
+     * Locates the node that covers a prefix.
+     *  @param  key         The prefix.
+     *  @return size_type   The index of the node (or of the leaf whose key
+     *                      postfix starts with the rest of the prefix),
+     *                      INVALID_INDEX if no key starts with the prefix.
+     */
+    size_type locate_ex(const char *key) const
+    {
+        size_type matched = 0;
+        return walk(INITIAL_INDEX, matched, key, std::strlen(key));
+    }
+
+    /**
+     * Extends a prefix located by locate_ex() or walk().
+     *  This allows to match many prefixes sharing their beginning (e.g., the
+     *  readings of a query) without starting over from the root.
+     *  @param  cur         The node of the prefix.
+     *  @param  matched     The number of characters of the prefix that lie
+     *                      in the key postfix of a leaf node cur (zero to
+     *                      start with); updated on success.
+     *  @param  str         The characters appended to the prefix.
+     *  @param  length      The number of the characters.
+     *  @return size_type   The node of the longer prefix, INVALID_INDEX if
+     *                      no key starts with it.
+     */
+    size_type walk(size_type cur, size_type &matched, const char *str, size_type length) const
+    {
+        const char *p = str;
+        const char *last = str + length;
+
+        for (; p != last; ++p)
+        {
+            base_type base = get_base(cur);
+            if (base < 0)
+            {
+                // The element #cur is a leaf node; the rest of the prefix
+                // must continue the key postfix in the TAIL.
+                itail tmp_itail(m_tail);
+                tmp_itail.seekg((size_type) - base);
+                size_type rest = (size_type)(last - p);
+                if (matched + rest <= tmp_itail.strlen() &&
+                    std::memcmp(tmp_itail.ptr() + matched, p, rest) == 0)
+                {
+                    matched += rest;
+                    return cur;
+                }
+                return INVALID_INDEX;
             }
 
             // Try to descend to the child node.
@@ -980,30 +1226,38 @@ protected:
             {
                 return cur;
             }
-
-            ++p;
         }
+        return cur;
+    }
 
-        if (last < p)
+protected:
+    struct rank_node
+    {
+        rank_type rank;
+        size_type index;
+
+        rank_node(rank_type r, size_type i) : rank(r), index(i)
         {
-            p = last;
         }
 
-        // Seek to the position of the key postfix in the TAIL.
-        tmp_itail.seekg(offset);
-
-        // Check if two key postfixes are identical.
-        if (tmp_itail.match_string(p))
+        // std::push_heap() keeps the largest element on top; reverse the
+        // order so that the best (smallest) rank comes out first.
+        bool operator<(const rank_node &rho) const
         {
-            return cur;
+            return rho.rank < rank;
         }
-        else
+    };
+
+    struct never_stop
+    {
+        bool operator()() const
         {
-            return INITIAL_INDEX;
+            return false;
         }
-    }
+    };
 
-    void getChildrenRecursive(size_type currentOffset, std::vector<KeyValuePair> &vecResult, int &nMaxCountNeeded, std::string &strCurrentKey)
+    template <class stop_type>
+    void getChildrenRecursive(size_type currentOffset, std::vector<KeyValuePair> &vecResult, int &nMaxCountNeeded, std::string &strCurrentKey, stop_type &stop)
     {
         if (currentOffset == 0 || nMaxCountNeeded <= 0)
         {
@@ -1020,6 +1274,10 @@ protected:
             {
                 continue;
             }
+            if (stop())
+            {
+                return;
+            }
 
             strCurrentKey.append(1, c);
 
@@ -1043,7 +1301,7 @@ protected:
                 return;
             }
 
-            getChildrenRecursive(nextOffset, vecResult, nMaxCountNeeded, strCurrentKey);
+            getChildrenRecursive(nextOffset, vecResult, nMaxCountNeeded, strCurrentKey, stop);
             strCurrentKey.erase(strCurrentKey.size() - 1);
         }
     }
@@ -1327,6 +1585,31 @@ public:
                 // "TAIL" chunk.
                 m_tail.assign(q, datasize);
 
+            }
+            else if (strncmp(chunk, "RANK", 4) == 0)
+            {
+                // "RANK" chunk: the best rank of the subtree of each element.
+                // Older indexes did not pad TAIL, so copy the ranks when
+                // they are not aligned.
+                m_rank.assign((rank_type *)q, datasize / sizeof(rank_type), !is_aligned(q, sizeof(rank_type)));
+
+            }
+            else if (strncmp(chunk, "TOPK", 4) == 0 && 2 * sizeof(uint32_t) <= datasize)
+            {
+                // "TOPK" chunk: #nodes, #items per node, (index, offset)
+                // pairs sorted by index, and then the values.
+                uint32_t num_nodes, topn;
+                q += read_uint32(q, num_nodes);
+                q += read_uint32(q, topn);
+                size_type index_size = 2 * sizeof(uint32_t) * num_nodes;
+                if (index_size <= datasize - 2 * sizeof(uint32_t))
+                {
+                    m_topk_index.assign((uint32_t *)q, 2 * num_nodes, !is_aligned(q, sizeof(uint32_t)));
+                    m_topk_n = num_nodes;
+                    m_topk_topn = topn;
+                    m_topk.assign(q + index_size, datasize - 2 * sizeof(uint32_t) - index_size);
+                }
+
             }
 
             p += size;
@@ -1338,6 +1621,12 @@ public:
             return 0;
         }
 
+        // Ignore subtree ranks that do not match the double array.
+        if (m_rank && m_rank.size() != m_da.size())
+        {
+            m_rank.free();
+        }
+
         return total_size;
     }
 
@@ -1406,6 +1695,11 @@ protected:
         return size;
     }
 
+    static bool is_aligned(const void *p, size_t alignment)
+    {
+        return (reinterpret_cast<uintptr_t>(p) & (alignment - 1)) == 0;
+    }
+
     size_type read_chunk(const uint8_t *block, char *chunk, uint32_t &size)
     {
         std::memcpy(chunk, block, 4);
@@ -1496,7 +1790,8 @@ public:
         double      da_usage;
         /// The size, in bytes, of the tail array.
         size_type   tail_size;
-        /// The sum of the number of trials for finding bases.
+        /// The sum of the number of trials for finding bases, each of
+        /// which tests 64 consecutive bases.
         size_type   bt_sum_base_trials;
         /// The average number of trials for finding bases.
         double      bt_avg_base_trials;
@@ -1511,21 +1806,33 @@ public:
      */
     typedef void (*callback_type)(void *instance, size_type i, size_type n);
 
-protected:
-    struct dlink_element_type
-    {
-        size_type prev;
-        size_type next;
-        dlink_element_type() : prev(0), next(0)
-        {
-        }
-    };
-    typedef std::vector<dlink_element_type> dlink_type;
+    /**
+     * The type of a rank function.
+     *  @param  value       The record value.
+     *  @return rank_type   The rank of the record (smaller is better).
+     */
+    typedef rank_type (*ranker_type)(const value_type &value);
+
+    /**
+     * The type of a function summarizing the records below a node.
+     *  @param  depth       The length of the prefix that the node represents.
+     *  @param  first       The pointer addressing the first record.
+     *  @param  last        The pointer addressing the position one past the
+     *                      final record.
+     *  @param[out] value   The value to be stored for the node.
+     *  @return bool        \c true to store the value for the node.
+     */
+    typedef bool (*summarizer_type)(size_type depth, const record_type *first, const record_type *last, value_type &value);
 
-    typedef std::vector<bool> baseusage_type;
+protected:
+    /// A bitmap, one bit per index; bits past the end are zero.
+    typedef std::vector<uint64_t> bitmap_type;
 
     void *m_instance;
     callback_type m_callback;
+    ranker_type m_ranker;
+    summarizer_type m_summarizer;
+    size_type m_topn;
 
     size_type m_i;
     size_type m_n;
@@ -1533,9 +1840,13 @@ protected:
     doublearray_type m_da;
     otail m_tail;
     uint8_t m_table[NUMCHARS];
+    std::vector<rank_type> m_rank;
+    otail m_topk;
+    std::vector<std::pair<size_type, size_type> > m_topk_index;
 
-    baseusage_type m_used_bases;
-    dlink_type m_elink;
+    bitmap_type m_used_cells;
+    bitmap_type m_used_bases;
+    size_type m_first_vacant_word;
 
     stat_type m_stat;
 
@@ -1544,7 +1855,7 @@ public:
      * Constructs a builder.
      */
     builder()
-        : m_instance(NULL), m_callback(NULL)
+        : m_instance(NULL), m_callback(NULL), m_ranker(NULL), m_summarizer(NULL), m_topn(0)
     {
     }
 
@@ -1566,6 +1877,33 @@ public:
         m_callback = callback;
     }
 
+    /**
+     * Sets a rank function.
+     *  When set, the builder records the best rank of every subtree and
+     *  writes it as a "RANK" chunk, which enables best-first enumeration
+     *  with dastrie::trie::getTopChildren().
+     *  @param  ranker      The rank function.
+     */
+    void set_ranker(ranker_type ranker)
+    {
+        m_ranker = ranker;
+    }
+
+    /**
+     * Sets a summary function.
+     *  When set, the builder calls the function for every internal node
+     *  and writes the values it returns as a "TOPK" chunk, which can be
+     *  read back with dastrie::trie::getTopValue().
+     *  @param  summarizer  The summary function.
+     *  @param  topn        The maximum number of items of a summary, stored
+     *                      in the chunk for the readers.
+     */
+    void set_summarizer(summarizer_type summarizer, size_type topn)
+    {
+        m_summarizer = summarizer;
+        m_topn = topn;
+    }
+
     /**
      * Builds a double-array trie from sorted records.
      *  @param  first       The pointer addressing the first record.
@@ -1582,10 +1920,14 @@ public:
 
         // Create the initial node.
         da_expand(INITIAL_INDEX + 1);
-        vlist_expand(INITIAL_INDEX + 1);
         set_base(INITIAL_INDEX, 1);
-        vlist_use(INITIAL_INDEX);
-        set_base(INITIAL_INDEX, arrange(0, first, last));
+        for (size_type i = 0; i <= INITIAL_INDEX; ++i)
+        {
+            cell_use(i);
+        }
+        rank_type rank;
+        set_base(INITIAL_INDEX, arrange(0, first, last, rank));
+        set_rank(INITIAL_INDEX, rank);
 
         //
         compute_stat();
@@ -1604,14 +1946,19 @@ public:
 
         // Initialize the double array.
         m_da.clear();
+        m_rank.clear();
+        m_topk.clear();
+        m_topk_index.clear();
         da_expand(1);
 
         // Initialize the tail array.
         m_tail.clear();
         m_tail.write<uint8_t>(0);
 
-        // Initialize the vacant linked list.
-        vlist_init();
+        // Initialize the bitmaps of used elements and bases.
+        m_used_cells.clear();
+        m_used_bases.clear();
+        m_first_vacant_word = 0;
 
         // Initialize the statistics.
         std::memset(&m_stat, 0, sizeof(m_stat));
@@ -1650,7 +1997,7 @@ public:
     }
 
 protected:
-    base_type arrange(size_type p, const record_type *first, const record_type *last)
+    base_type arrange(size_type p, const record_type *first, const record_type *last, rank_type &rank)
     {
         size_type i;
         const record_type *it;
@@ -1670,6 +2017,7 @@ protected:
             }
             m_tail.write_string(rec.key, p);
             m_tail << rec.value;
+            rank = (m_ranker != NULL) ? m_ranker(rec.value) : 0;
 
             if (m_callback != NULL)
             {
@@ -1721,54 +2069,38 @@ protected:
 
         // Find the minimum of the base address (base) that can store every
         // child. This step would be very time consuming if we tried base
-        // indexes from 1 one by one and tested the vacanies for child nodes.
-        // Instead, we try to determine the index number of the first child-
-        // node by using a double-linked list of vacant nodes, and calculate
-        // back the base address from the index number of the child node.
-        size_type base = 0, index = 0;
-        for (;;)
+        // indexes from 1 one by one and tested the vacancies for child nodes.
+        // Instead, we test 64 consecutive bases at a time on the bitmaps of
+        // used elements and bases: shifting the bitmap of used elements by
+        // the offset of each child and OR-ing the words leaves a zero bit at
+        // every base which can store all the children. The search starts at
+        // the first word with a vacant element, as the front of the double
+        // array is mostly full.
+        size_type base = 0;
+        size_type from = m_first_vacant_word * 64;
+        size_type window = (from < children[0].offset) ? 0 : (from - children[0].offset) / 64;
+        for (;; ++window)
         {
             ++m_stat.bt_sum_base_trials;
 
-            // Obtain the index value of a next vacant node.
-            index = vlist_next(index);
-
-            // A base value must be greater than 1.
-            if (index < INITIAL_INDEX + children[0].offset)
+            size_type start = window * 64;
+            uint64_t used = bitmap_word(m_used_bases, start);
+            if (start < INITIAL_INDEX)
             {
-                // The index is too small for a base value; try next.
-                continue;
+                // A base value must not be smaller than INITIAL_INDEX.
+                used |= ((uint64_t)1 << (INITIAL_INDEX - start)) - 1;
             }
-
-            // Calculate back the base value from the index.
-            base = index - children[0].offset;
-
-            // A base value must not be used by other places.
-            if (base < m_used_bases.size() && m_used_bases[base])
-            {
-                continue;
-            }
-
-            // Expand the double array and vacant list if necessary.
-            da_expand(base + max_offset + 1);
-            vlist_expand(base + max_offset + 1);
-
-            // Check if the base address can store every child in the list.
-            for (i = 1; i < num_children; ++i)
+            for (i = 0; i < num_children && ~used != 0; ++i)
             {
-                size_type offset = children[i].offset;
-                if (da_in_use(base + offset))
-                {
-                    break;
-                }
+                used |= bitmap_word(m_used_cells, start + children[i].offset);
             }
-
-            // Exit the loop if successful.
-            if (i == num_children)
+            if (~used != 0)
             {
+                base = start + (size_type)__builtin_ctzll(~used);
                 break;
             }
         }
+        da_expand(base + max_offset + 1);
 
         // Fail if the double array could not store the child nodes.
         if ((size_type)doublearray_traits::max_base() <= base + max_offset)
@@ -1777,11 +2109,7 @@ protected:
         }
 
         // Register the usage of the base address.
-        if (m_used_bases.size() <= base)
-        {
-            m_used_bases.resize(base + 1, false);
-        }
-        m_used_bases[base] = true;
+        bitmap_set(m_used_bases, base);
 
         // Reserve the double-array elements for the child nodes by filling
         // BASE = 1 tentatively. This step protects these elements from being
@@ -1791,19 +2119,22 @@ protected:
         {
             size_type offset = children[i].offset;
             set_base(base + offset, 1);
-            vlist_use(base + offset);
+            cell_use(base + offset);
         }
 
         // Set BASE and CHECK values of each child node.
+        rank = worst_rank();
         for (i = 0; i < num_children; ++i)
         {
             const child_t &child = children[i];
             size_type offset = child.offset;
+            rank_type child_rank;
             if (child.c != 0)
             {
                 // Set the base value of a child node by recursively arranging
                 // the descendant nodes.
-                set_base(base + offset, arrange(p + 1, child.first, child.last));
+                set_base(base + offset, arrange(p + 1, child.first, child.last, child_rank));
+                summarize(base + offset, p + 1, child.first, child.last);
             }
             else
             {
@@ -1812,9 +2143,11 @@ protected:
                     throw exception("Duplicated keys detected");
                 }
                 // Force to insert '\0' in the TAIL.
-                set_base(base + offset, arrange(p, child.first, child.last));
+                set_base(base + offset, arrange(p, child.first, child.last, child_rank));
             }
             set_check(base + offset, (uint8_t)(offset - 1));
+            set_rank(base + offset, child_rank);
+            rank = std::min(rank, child_rank);
         }
 
         ++m_stat.da_num_nodes;
@@ -1858,6 +2191,29 @@ protected:
         doublearray_traits::set_check(m_da[i], v);
     }
 
+    void summarize(size_type i, size_type depth, const record_type *first, const record_type *last)
+    {
+        value_type value;
+        if (m_summarizer != NULL && first + 1 != last &&
+            m_summarizer(depth, first, last, value))
+        {
+            m_topk_index.push_back(std::make_pair(i, m_topk.tellp()));
+            m_topk << value;
+        }
+    }
+
+    inline void set_rank(size_type i, rank_type v)
+    {
+        if (m_ranker != NULL)
+        {
+            if (m_rank.size() <= i)
+            {
+                m_rank.resize(i + 1, worst_rank());
+            }
+            m_rank[i] = v;
+        }
+    }
+
     inline bool da_in_use(size_type i) const
     {
         return (i < m_da.size() && get_base(i) != 0);
@@ -1871,48 +2227,36 @@ protected:
         }
     }
 
-    void vlist_init()
-    {
-        m_elink.resize(1);
-        m_elink[0].next = 1;
-        m_elink[0].prev = 0;
-    }
-
-    inline size_type vlist_next(size_type i)
+    // The 64 bits of the bitmap from the bit i.
+    static inline uint64_t bitmap_word(const bitmap_type &bm, size_type i)
     {
-        return (i < m_elink.size()) ? m_elink[i].next : i + 1;
+        size_type w = i / 64, shift = i % 64;
+        uint64_t lo = (w < bm.size()) ? bm[w] : 0;
+        if (shift == 0)
+        {
+            return lo;
+        }
+        uint64_t hi = (w + 1 < bm.size()) ? bm[w + 1] : 0;
+        return (lo >> shift) | (hi << (64 - shift));
     }
 
-    void vlist_expand(size_type size)
+    static inline void bitmap_set(bitmap_type &bm, size_type i)
     {
-        if (m_elink.size() < size)
+        if (bm.size() <= i / 64)
         {
-            size_type first = m_elink.size();
-            m_elink.resize(size);
-
-            size_type back = m_elink[0].prev;
-            for (size_type i = first; i < m_elink.size(); ++i)
-            {
-                m_elink[i].prev = back;
-                m_elink[i].next = i + 1;
-                back = i;
-            }
-            m_elink[0].prev = m_elink.size() - 1;
+            bm.resize(i / 64 + 1, 0);
         }
+        bm[i / 64] |= (uint64_t)1 << (i % 64);
     }
 
-    void vlist_use(size_type i)
+    inline void cell_use(size_type i)
     {
-        size_type prev = m_elink[i].prev;
-        size_type next = m_elink[i].next;
-        if (m_elink.size() <= next)
+        bitmap_set(m_used_cells, i);
+        while (m_first_vacant_word < m_used_cells.size() &&
+               m_used_cells[m_first_vacant_word] == ~(uint64_t)0)
         {
-            m_elink.resize(next + 1);
-            m_elink[next].next = next + 1;
-            m_elink[0].prev = next; // The rightmost vacant node.
+            ++m_first_vacant_word;
         }
-        m_elink[prev].next = next;
-        m_elink[next].prev = prev;
     }
 
 protected:
@@ -1974,8 +2318,13 @@ public:
         // Calculate the size of each chunk.
         size_type sda_size = CHUNKSIZE + sizeof(m_da[0]) * m_da.size();
         size_type tblu_size = CHUNKSIZE + sizeof(uint8_t) * NUMCHARS;
-        size_type tail_size = CHUNKSIZE +  m_tail.bytes();
-        size_type total_size = SDAT_CHUNKSIZE + tblu_size + sda_size + tail_size;
+        // The tail is padded to end on a 4-byte boundary, so that the
+        // RANK and TOPK arrays after it are aligned in a mapped index.
+        size_type tail_end = SDAT_CHUNKSIZE + tblu_size + sda_size + CHUNKSIZE + m_tail.bytes();
+        size_type tail_size = CHUNKSIZE + m_tail.bytes() + align_size(tail_end) - tail_end;
+        size_type rank_size = (m_ranker != NULL) ? CHUNKSIZE + sizeof(rank_type) * m_da.size() : 0;
+        size_type topk_size = (m_summarizer != NULL) ? CHUNKSIZE + sizeof(uint32_t) * (2 + 2 * m_topk_index.size()) + m_topk.bytes() : 0;
+        size_type total_size = SDAT_CHUNKSIZE + tblu_size + sda_size + tail_size + rank_size + topk_size;
 
         // Write a "SDAT" chunk.
         write_chunk(os, "SDAT", total_size);
@@ -1992,7 +2341,34 @@ public:
 
         // Write a chunk for the tail array.
         write_chunk(os, "TAIL", tail_size);
-        write_data(os, m_tail.block(), tail_size - CHUNKSIZE);
+        write_data(os, m_tail.block(), m_tail.bytes());
+        write_padding(os, tail_size - CHUNKSIZE - m_tail.bytes());
+
+        // Write a chunk for the subtree ranks.
+        if (0 < rank_size)
+        {
+            m_rank.resize(m_da.size(), worst_rank());
+            write_chunk(os, "RANK", rank_size);
+            write_data(os, &m_rank[0], rank_size - CHUNKSIZE);
+        }
+
+        // Write a chunk for the precomputed values of nodes.
+        if (0 < topk_size)
+        {
+            std::sort(m_topk_index.begin(), m_topk_index.end());
+            write_chunk(os, "TOPK", topk_size);
+            write_uint32(os, (uint32_t)m_topk_index.size());
+            write_uint32(os, (uint32_t)m_topn);
+            for (size_type i = 0; i < m_topk_index.size(); ++i)
+            {
+                write_uint32(os, (uint32_t)m_topk_index[i].first);
+                write_uint32(os, (uint32_t)m_topk_index[i].second);
+            }
+            if (0 < m_topk.bytes())
+            {
+                write_data(os, m_topk.block(), m_topk.bytes());
+            }
+        }
     }
 
 protected:
@@ -2006,6 +2382,17 @@ protected:
         os.write(reinterpret_cast<const char *>(data), size);
     }
 
+    void write_padding(std::ostream &os, size_t size)
+    {
+        static const char zeros[sizeof(uint32_t)] = {0};
+        write_data(os, zeros, size);
+    }
+
+    static size_type align_size(size_type size)
+    {
+        return (size + sizeof(uint32_t) - 1) & ~(size_type)(sizeof(uint32_t) - 1);
+    }
+
     void write_chunk(std::ostream &os, const char *chunk, size_type size)
     {
         os.write(chunk, 4);
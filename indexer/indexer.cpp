@@ -1,6 +1,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <malloc.h>
 
 #include <fstream>
 #include <iostream>
@@ -11,22 +16,40 @@
 #include <unordered_map>
 
 #include "dastrie.h"
+#include "pinyin.h"
 #include "util.h"
 
 using namespace std;
 using std::unordered_map;
 
 #define MAX_FILE_LEN 256
-#define INITIAL_HASH_SIZE 100000
 #define DEFAULT_CHINESE_MAP "./chinese"
 #define DEFAULT_INPUT_RANK_FILE "./input"
 #define DEFAULT_OUTPUT_INDEX "./index"
+#define DEFAULT_TOPK_DEPTH 4
+#define DEFAULT_TOPK_NUM 20
+#define DEFAULT_TMP_DIR "/tmp"
+/* peak memory of the converted keys per byte of input, 5 to 10 measured on copies of ./input */
+#define KEY_BYTES_PER_INPUT_BYTE 10
+/* spilled runs of a level merged into one of the next */
+#define MERGE_FANIN 16
+/* peak memory of the build per byte of the merged records, 2 to 2.2 measured on copies of ./input */
+#define BUILD_BYTES_PER_RECORD_BYTE 2.5
+/* part of the -M memory the sort phase gets without -S */
+#define SORT_SHARE_OF_BUILD_MEMORY 4
 
 typedef struct conf
 {
     char chinese_map_file[MAX_FILE_LEN];
     char input_rank_file[MAX_FILE_LEN];
     char output_index_file[MAX_FILE_LEN];
+    char output_pinyin_file[MAX_FILE_LEN];
+    int topk_depth;
+    int topk_num;
+    int threads;
+    int sort_memory_mb;     /* memory of the convert and sort phase, parts beyond it are spilled, 0 for no limit */
+    int build_memory_mb;    /* memory of the whole build, which fails beyond it, 0 for no limit */
+    char tmp_dir[MAX_FILE_LEN];
 } conf;
 conf g_conf;
 
@@ -55,11 +78,20 @@ void usage();
 void usage()
 {
     printf("The Tool is used to build index for prefix match.\n");
-    printf("index [-C-I-O-h]\n");
+    printf("index [-C-I-O-B-D-N-j-M-S-T-h]\n");
     printf("\t-h\t print usage\n");
-    printf("\t-C\t the Chinese to letter convert file\n");
+    printf("\t-C\t the Chinese to letter convert file, text or compiled\n");
     printf("\t-I\t Input rank file\n");
     printf("\t-O\t Output index file\n");
+    printf("\t-B\t Output the compiled Chinese to letter convert file, which the server loads faster\n");
+    printf("\t-D\t Precompute the best items of prefixes up to this length (default %d)\n", DEFAULT_TOPK_DEPTH);
+    printf("\t-N\t Number of items precomputed for each prefix, 0 to disable (default %d)\n", DEFAULT_TOPK_NUM);
+    printf("\t-j\t Number of threads converting the input (default: the number of cpus)\n");
+    printf("\t-M\t Memory in MB of the whole build. The input is sorted as with -S, and the build stops with\n"
+           "\t\t an error when the merged records and the trie would need more (default: no limit)\n");
+    printf("\t-S\t Memory in MB of the convert and sort phase, the input is converted in parts of that size\n"
+           "\t\t and each part is spilled to disk sorted (default: a quarter of the -M memory, or no limit)\n");
+    printf("\t-T\t Directory of the spilled runs (default %s)\n", DEFAULT_TMP_DIR);
 }
 
 class NodeItem
@@ -118,35 +150,61 @@ public:
     }
 };
 
+//the best rank of a record, stored for every subtree of the trie
+dastrie::rank_type rank_of(const string_array &value)
+{
+    dastrie::rank_type rank = dastrie::worst_rank();
+    for (size_t i = 0; i < value.size(); ++i)
+    {
+        rank = min(rank, (dastrie::rank_type)value[i].fRank);
+    }
+    return rank;
+}
+
 typedef dastrie::builder<std::string, string_array> builder_type;
 typedef builder_type::record_type record_type;
-typedef unordered_map<string, vector<string> > hashMap;
-hashMap chinese_map(INITIAL_HASH_SIZE);
 
-int read_chinese_map(const string &strFile, hashMap &chinese_map)
+//the best g_conf.topk_num items below a short prefix, without duplicated names
+bool top_items_of(builder_type::size_type depth, const record_type *first, const record_type *last, string_array &value)
 {
-    int file_strLine = 0;
-    ifstream inf(strFile.c_str());
-    if (!inf.is_open())
+    if (depth > (builder_type::size_type)g_conf.topk_depth)
     {
-        return -1;
+        return false;
     }
 
-    string strLine;
-    while (getline(inf, strLine))
+    map<string, float> mBest;
+    for (const record_type *rec = first; rec != last; ++rec)
     {
-        strLine = trim(strLine, " \t\r", 1);
-        vector<string> vResult = sepstr(strLine, " ");
-        if (vResult.size() < 2)
+        for (size_t i = 0; i < rec->value.size(); ++i)
         {
-            continue;
+            const NodeItem &item = rec->value[i];
+            map<string, float>::iterator it = mBest.find(item.strName);
+            if (it == mBest.end())
+            {
+                mBest[item.strName] = item.fRank;
+            }
+            else if (item.fRank < it->second)
+            {
+                it->second = item.fRank;
+            }
         }
-        chinese_map[vResult[0]] = vector<string>(++(vResult.begin()), vResult.end());
-        ++file_strLine;
     }
-    printf("file count %d in file %s\n", file_strLine, strFile.c_str());
-    return 0;
+
+    NodeItem item;
+    value.clear();
+    value.reserve(mBest.size());
+    for (map<string, float>::iterator it = mBest.begin(); it != mBest.end(); ++it)
+    {
+        item.strName = it->first;
+        item.fRank = it->second;
+        value.push_back(item);
+    }
+    size_t n = min(value.size(), (size_t)g_conf.topk_num);
+    partial_sort(value.begin(), value.begin() + n, value.end(), rank_compare);
+    value.resize(n);
+    return true;
 }
+pinyin_map chinese_map;
 
 void get_all_results(const vector< vector<string> > &vecAll, vector<string> &vOut)
 {
@@ -195,7 +253,7 @@ int all_english_char(const string &strIn)
     return 1;
 }
 
-void convert_to_letters(const string &strIn, hashMap &hz2pyTable, vector<string> &vOut)
+void convert_to_letters(const string &strIn, const pinyin_map &hz2pyTable, vector<string> &vOut)
 {
     int all_chinese_flag = 1;
 
@@ -213,24 +271,27 @@ void convert_to_letters(const string &strIn, hashMap &hz2pyTable, vector<string>
     const char *pEnd = p + strIn.size();
     while (p < pEnd)
     {
-        size_t s = getUTF8Len(p);
-        if (s <= 1)
+        const char *q = p;
+        const uint16_t *ids;
+        uint32_t n = pinyin_readings(hz2pyTable, decode_utf8(p, pEnd), ids);
+        if (p - q <= 1)
         {
             all_chinese_flag = 0;
         }
-        string strKey(p, s);
-        hashMap::iterator iter = hz2pyTable.find(strKey);
-        if (iter != hz2pyTable.end())
+        if (n > 0)
         {
-            vecAll.push_back(iter->second);
+            vector<string> vAll;
             vector<string> vTmp;
-            for (size_t i = 0 ; i < iter->second.size() ; ++i)
+            for (uint32_t i = 0 ; i < n ; ++i)
             {
-                vTmp.push_back(iter->second[i].substr(0, 1));
+                uint32_t length;
+                const char *syllable = pinyin_syllable(hz2pyTable, ids[i], length);
+                vAll.push_back(string(syllable, length));
+                vTmp.push_back(string(syllable, 1));
             }
+            vecAll.push_back(vAll);
             vecFC.push_back(vTmp);
         }
-        p += s;
     }
     get_all_results(vecAll, vOut);
     if (all_chinese_flag == 1)
@@ -241,65 +302,517 @@ void convert_to_letters(const string &strIn, hashMap &hz2pyTable, vector<string>
     }
 }
 
-int create_index(const char *input_rank_file, char *output_index_file)
+//milliseconds since the previous call, for the timings of the phases
+double elapsed_ms(struct timeval &last)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    double ms = (now.tv_sec - last.tv_sec) * 1000.0 + (now.tv_usec - last.tv_usec) / 1000.0;
+    last = now;
+    return ms;
+}
+
+/* one key of the index with one of its items */
+typedef struct key_item
 {
-    string strLine;
+    string key;
+    size_t seq;         /* offset of the line in the input, keeps the items of a key in file order */
     NodeItem item;
+} key_item;
+
+bool key_item_compare(const key_item &a, const key_item &b)
+{
+    int ret = a.key.compare(b.key);
+    return ret < 0 || (ret == 0 && a.seq < b.seq);
+}
+
+/* a part of the input converted by one thread into a sorted run of keys */
+typedef struct expand_task
+{
+    const char *begin;
+    const char *end;
+    const char *input;
+    size_t base;        /* offset of input in the input file */
+    vector<key_item> run;
+} expand_task;
+
+/* a sorted run spilled to disk, merged from MERGE_FANIN^level parts */
+typedef struct spill_run
+{
+    FILE *fp;
+    int level;
+} spill_run;
+
+/* a sorted run being merged, in memory or spilled to disk */
+typedef struct run_cursor
+{
+    vector<key_item> *run;
+    size_t pos;
+    FILE *spill;
+    key_item current;
+} run_cursor;
+
+int write_key_item(FILE *fp, const key_item &ki)
+{
+    uint32_t key_len = ki.key.size();
+    uint32_t name_len = ki.item.strName.size();
+    uint64_t seq = ki.seq;
+    fwrite(&key_len, sizeof(key_len), 1, fp);
+    fwrite(ki.key.data(), 1, key_len, fp);
+    fwrite(&seq, sizeof(seq), 1, fp);
+    fwrite(&name_len, sizeof(name_len), 1, fp);
+    fwrite(ki.item.strName.data(), 1, name_len, fp);
+    fwrite(&ki.item.fRank, sizeof(ki.item.fRank), 1, fp);
+    return ferror(fp) ? -1 : 0;
+}
+
+bool read_key_item(FILE *fp, key_item &ki)
+{
+    uint32_t len;
+    uint64_t seq;
+    if (fread(&len, sizeof(len), 1, fp) != 1)
+    {
+        return false;
+    }
+    ki.key.resize(len);
+    if (len > 0 && fread(&ki.key[0], 1, len, fp) != len)
+    {
+        return false;
+    }
+    if (fread(&seq, sizeof(seq), 1, fp) != 1 || fread(&len, sizeof(len), 1, fp) != 1)
+    {
+        return false;
+    }
+    ki.seq = seq;
+    ki.item.strName.resize(len);
+    if (len > 0 && fread(&ki.item.strName[0], 1, len, fp) != len)
+    {
+        return false;
+    }
+    return fread(&ki.item.fRank, sizeof(ki.item.fRank), 1, fp) == 1;
+}
+
+//an anonymous temporary file in dir, gone once closed
+FILE *spill_file(const char *dir)
+{
+    char path[MAX_FILE_LEN];
+    snprintf(path, sizeof(path), "%s/indexer.run.XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    unlink(path);
+    return fdopen(fd, "w+b");
+}
+
+bool run_next(run_cursor &c)
+{
+    if (c.spill)
+    {
+        return read_key_item(c.spill, c.current);
+    }
+    if (c.pos >= c.run->size())
+    {
+        return false;
+    }
+    swap(c.current, (*c.run)[c.pos++]);
+    return true;
+}
+
+void *expand_worker(void *arg)
+{
+    expand_task *task = (expand_task *)arg;
     vector<string> vChinese;
-    map<string, string_array> mLetterToItems;
+    key_item ki;
 
-    string strInput(input_rank_file);
-    string strOutput(output_index_file);
+    const char *p = task->begin;
+    while (p < task->end)
+    {
+        const char *eol = (const char *)memchr(p, '\n', task->end - p);
+        if (eol == NULL)
+        {
+            eol = task->end;
+        }
+        string strLine(p, eol);
+        ki.seq = task->base + (p - task->input);
+        p = eol + 1;
+
+        vector<string> vResult = sepstr(strLine, "\t");
+        if (vResult.size() != 2)
+        {
+            printf("the line must have 2 fields\n");
+            continue;
+        }
+        ki.item.strName = vResult[0];
+        ki.item.fRank = atof(vResult[1].c_str());
+        convert_to_letters(strLine, chinese_map, vChinese);
+        for (vector<string>::iterator it = vChinese.begin(); it != vChinese.end(); ++it)
+        {
+            ki.key = *it;
+            task->run.push_back(ki);
+        }
+    }
+
+    sort(task->run.begin(), task->run.end(), key_item_compare);
+    return NULL;
+}
+
+/* merge the sorted runs, handing their key items to sink in order until it returns false */
+template <typename sink_type>
+bool merge_runs(vector<run_cursor> &runs, sink_type &sink)
+{
+    //a min-heap of the runs, by their current key item
+    struct cursor_greater
+    {
+        vector<run_cursor> *runs;
+        bool operator()(size_t a, size_t b) const
+        {
+            return key_item_compare((*runs)[b].current, (*runs)[a].current);
+        }
+    } greater;
+    greater.runs = &runs;
+
+    vector<size_t> heap;
+    for (size_t i = 0; i < runs.size(); ++i)
+    {
+        if (run_next(runs[i]))
+        {
+            heap.push_back(i);
+        }
+    }
+    make_heap(heap.begin(), heap.end(), greater);
+
+    while (!heap.empty())
+    {
+        pop_heap(heap.begin(), heap.end(), greater);
+        run_cursor &c = runs[heap.back()];
+
+        if (!sink(c.current))
+        {
+            return false;
+        }
+
+        if (run_next(c))
+        {
+            push_heap(heap.begin(), heap.end(), greater);
+        }
+        else
+        {
+            heap.pop_back();
+        }
+    }
+    return true;
+}
+
+/* groups the merged key items into records, one per key, while they fit in limit bytes */
+struct record_sink
+{
+    vector<record_type> *records;
+    size_t bytes;       /* estimated memory of the records */
+    size_t limit;       /* 0 for no limit */
+    bool operator()(key_item &ki)
+    {
+        if (records->empty() || records->back().key != ki.key)
+        {
+            records->push_back(record_type());
+            records->back().key.swap(ki.key);
+            bytes += sizeof(record_type) + records->back().key.size();
+        }
+        records->back().value.push_back(ki.item);
+        bytes += sizeof(NodeItem) + ki.item.strName.size();
+        return limit == 0 || bytes <= limit;
+    }
+};
+
+struct spill_sink
+{
+    FILE *fp;
+    bool operator()(key_item &ki)
+    {
+        return write_key_item(fp, ki) == 0;
+    }
+};
+
+/* merge the runs into one new spill file, rewound for reading */
+FILE *merge_to_spill(vector<run_cursor> &runs)
+{
+    spill_sink sink;
+    sink.fp = spill_file(g_conf.tmp_dir);
+    if (sink.fp == NULL)
+    {
+        printf("failed to create a spill file in %s\n", g_conf.tmp_dir);
+        return NULL;
+    }
+    if (!merge_runs(runs, sink) || fflush(sink.fp) != 0)
+    {
+        printf("failed to write a spilled run\n");
+        fclose(sink.fp);
+        return NULL;
+    }
+    rewind(sink.fp);
+    return sink.fp;
+}
+
+//closes the spilled runs from the index from on
+void close_spills(vector<spill_run> &spills, size_t from)
+{
+    for (size_t i = from; i < spills.size(); ++i)
+    {
+        fclose(spills[i].fp);
+    }
+    spills.resize(from);
+}
+
+/* cursors over the runs of the tasks and the spilled runs from the index from on */
+void open_runs(vector<expand_task> &tasks, vector<spill_run> &spills, size_t from, vector<run_cursor> &runs)
+{
+    runs.clear();
+    for (size_t i = 0; i < tasks.size(); ++i)
+    {
+        run_cursor c;
+        c.run = &tasks[i].run;
+        c.pos = 0;
+        c.spill = NULL;
+        runs.push_back(c);
+    }
+    for (size_t i = from; i < spills.size(); ++i)
+    {
+        run_cursor c;
+        c.run = NULL;
+        c.pos = 0;
+        c.spill = spills[i].fp;
+        runs.push_back(c);
+    }
+}
+
+/*
+ * Adds the spilled run of a part. Like the digits of a counter in base
+ * MERGE_FANIN, the last MERGE_FANIN runs of a level are merged into one of
+ * the next level, so every key item is rewritten once per level and at
+ * most MERGE_FANIN - 1 runs per level stay open.
+ */
+int add_spill(vector<spill_run> &spills, FILE *fp, vector<run_cursor> &runs)
+{
+    spill_run run = {fp, 0};
+    spills.push_back(run);
+    while (spills.size() >= MERGE_FANIN && spills[spills.size() - MERGE_FANIN].level == spills.back().level)
+    {
+        size_t from = spills.size() - MERGE_FANIN;
+        vector<expand_task> none;
+        open_runs(none, spills, from, runs);
+        run.fp = merge_to_spill(runs);
+        run.level = spills.back().level + 1;
+        close_spills(spills, from);
+        if (run.fp == NULL)
+        {
+            return -1;
+        }
+        spills.push_back(run);
+    }
+    return 0;
+}
+
+/*
+ * Reads the next part of the input, at most limit bytes but whole lines,
+ * after the rest of the previous part kept in carry.
+ */
+bool read_segment(ifstream &infile, size_t limit, string &segment, string &carry)
+{
+    segment.swap(carry);
+    carry.clear();
+    size_t used = segment.size();
+    if (used < limit)
+    {
+        segment.resize(limit);
+        infile.read(&segment[used], limit - used);
+        segment.resize(used + infile.gcount());
+    }
+    if (segment.empty())
+    {
+        return false;
+    }
+
+    //a line longer than the part is read on to its end, not cut in two
+    size_t eol = segment.rfind('\n');
+    while (infile && eol == string::npos)
+    {
+        size_t size = segment.size();
+        segment.resize(size + limit);
+        infile.read(&segment[size], limit);
+        segment.resize(size + infile.gcount());
+        eol = segment.find('\n', size);
+    }
+
+    //keep a partial last line for the next part
+    if (infile && eol != string::npos && eol + 1 < segment.size())
+    {
+        carry.assign(segment, eol + 1, string::npos);
+        segment.resize(eol + 1);
+    }
+    return true;
+}
+
+int create_index(const char *input_rank_file, char *output_index_file)
+{
+    struct timeval last;
+    gettimeofday(&last, NULL);
+    double convert_ms = 0.0, read_ms = 0.0;
 
-    ifstream infile(strInput);
+    string strOutput(output_index_file);
+    ifstream infile(input_rank_file, ios::binary);
     if (!infile.is_open())
     {
         printf("failed to open file %s\n", input_rank_file);
         return -1;
     }
 
-    while (getline(infile, strLine))
+    //without a ceiling the whole input is one part and the runs stay in memory
+    int sort_memory_mb = g_conf.sort_memory_mb;
+    if (sort_memory_mb == 0 && g_conf.build_memory_mb > 0)
     {
-        vector<string> vResult = sepstr(strLine, "\t");
-        size_t uCount = vResult.size();
-        if (2 == uCount)
+        sort_memory_mb = max(g_conf.build_memory_mb / SORT_SHARE_OF_BUILD_MEMORY, 1);
+    }
+    if (g_conf.build_memory_mb > 0 && sort_memory_mb >= g_conf.build_memory_mb)
+    {
+        printf("the %d MB of -S leave nothing of the %d MB of -M to build the trie\n", sort_memory_mb, g_conf.build_memory_mb);
+        return -1;
+    }
+    bool spill = sort_memory_mb > 0;
+    size_t limit = spill ? ((size_t)sort_memory_mb << 20) / KEY_BYTES_PER_INPUT_BYTE : (size_t) - 1;
+    if (!spill)
+    {
+        infile.seekg(0, ios::end);
+        limit = max((size_t)infile.tellg(), (size_t)1);
+        infile.seekg(0, ios::beg);
+    }
+
+    int nthreads = g_conf.threads > 0 ? g_conf.threads : 1;
+    vector<expand_task> tasks(nthreads);
+    vector<spill_run> spills;   /* one sorted file per part, merged MERGE_FANIN at a time */
+    vector<run_cursor> runs;
+    size_t nkeys = 0, nsegments = 0, base = 0;
+    string segment, carry;
+    while (true)
+    {
+        if (!read_segment(infile, limit, segment, carry))
         {
-            item.strName = vResult[0];
-            item.fRank = atof(vResult[1].c_str());
+            break;
         }
-        if (uCount != 2)
+        read_ms += elapsed_ms(last);
+
+        //cut the part into one piece per thread, at line ends
+        const char *begin = segment.data();
+        const char *end = begin + segment.size();
+        const char *p = begin;
+        for (int i = 0; i < nthreads; ++i)
         {
-            printf("the line must have 2 fields\n");
-            continue;
+            expand_task &task = tasks[i];
+            task.input = begin;
+            task.base = base;
+            task.begin = p;
+            p = (i == nthreads - 1) ? end : max(p, begin + segment.size() * (i + 1) / nthreads);
+            while (p < end && p[-1] != '\n')
+            {
+                ++p;
+            }
+            task.end = p;
         }
-        convert_to_letters(strLine, chinese_map, vChinese);
-        if (vChinese.size() > 0)
+
+        vector<pthread_t> tids(nthreads);
+        for (int i = 0; i < nthreads; ++i)
+        {
+            if (pthread_create(&tids[i], NULL, expand_worker, &tasks[i]) != 0)
+            {
+                printf("failed to create thread\n");
+                exit(-1);
+            }
+        }
+        for (int i = 0; i < nthreads; ++i)
+        {
+            pthread_join(tids[i], NULL);
+            nkeys += tasks[i].run.size();
+        }
+        base += segment.size();
+        ++nsegments;
+
+        if (spill)
         {
-            for (vector<string>::iterator it = vChinese.begin(); it != vChinese.end(); ++it)
+            //the runs of the part go to disk as one, the threads use the memory again
+            open_runs(tasks, spills, spills.size(), runs);
+            FILE *fp = merge_to_spill(runs);
+            for (int i = 0; i < nthreads; ++i)
             {
-                mLetterToItems[*it].push_back(item);
+                vector<key_item>().swap(tasks[i].run);
+            }
+            if (fp == NULL || add_spill(spills, fp, runs) != 0)
+            {
+                close_spills(spills, 0);
+                return -1;
             }
         }
-        vChinese.clear();
+        convert_ms += elapsed_ms(last);
     }
     infile.close();
-
+    string().swap(segment);
+    //give back what we can, the trie is built in big arrays which do not reuse freed key items
+    malloc_trim(0);
+    printf("phase read: %.1f ms, %zu bytes in %zu parts\n", read_ms, base, nsegments);
+    printf("phase convert and sort: %.1f ms, %d threads, %zu keys%s\n", convert_ms, nthreads, nkeys, spill ? " spilled" : "");
+
+    /*
+     * The records and the trie built from them are in memory together, and
+     * with what the sort phase used: the malloc arenas of the convert
+     * threads keep it.
+     */
     vector<record_type> allRecords;
-    allRecords.reserve(mLetterToItems.size());
-    for (map<string, string_array>::iterator it = mLetterToItems.begin(); it != mLetterToItems.end(); ++it)
+    record_sink sink;
+    sink.records = &allRecords;
+    sink.bytes = 0;
+    sink.limit = 0;
+    if (g_conf.build_memory_mb > 0)
+    {
+        sink.limit = ((size_t)(g_conf.build_memory_mb - sort_memory_mb) << 20) / BUILD_BYTES_PER_RECORD_BYTE;
+    }
+    //the runs of the tasks are empty after a spilled part
+    open_runs(tasks, spills, 0, runs);
+    bool fit = merge_runs(runs, sink);
+    close_spills(spills, 0);
+    for (int i = 0; i < nthreads; ++i)
+    {
+        vector<key_item>().swap(tasks[i].run);
+    }
+    if (!fit)
     {
-        record_type record;
-        record.key = it->first;
-        record.value = it->second;
+        printf("the records and the trie need more than the %d MB of -M, stopped after %zu records,"
+               " raise -M or lower -S\n", g_conf.build_memory_mb, allRecords.size());
+        return -1;
+    }
+    printf("phase merge: %.1f ms, %zu records of about %zu MB\n", elapsed_ms(last), allRecords.size(), sink.bytes >> 20);
 
-        allRecords.push_back(record);
+    if (allRecords.size() == 0)
+    {
+        printf("no record in file %s\n", input_rank_file);
+        return -1;
     }
 
     builder_type builder;
-    builder.build(&allRecords[0], &allRecords[allRecords.size() - 1]);
+    builder.set_ranker(rank_of);
+    if (g_conf.topk_num > 0 && g_conf.topk_depth > 0)
+    {
+        builder.set_summarizer(top_items_of, g_conf.topk_num);
+    }
+    builder.build(&allRecords[0], &allRecords[0] + allRecords.size());
+    printf("phase build: %.1f ms\n", elapsed_ms(last));
+
     std::ofstream ofs(strOutput, std::ios::binary);
     builder.write(ofs);
     ofs.close();
+    printf("phase write: %.1f ms\n", elapsed_ms(last));
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("peak memory: %ld MB\n", usage.ru_maxrss >> 10);
     return 0;
 }
 
@@ -309,6 +822,12 @@ void init_default_conf()
     CONF_SET_STR_VALUE(chinese_map_file, DEFAULT_CHINESE_MAP);
     CONF_SET_STR_VALUE(input_rank_file, DEFAULT_INPUT_RANK_FILE);
     CONF_SET_STR_VALUE(output_index_file, DEFAULT_OUTPUT_INDEX);
+    g_conf.topk_depth = DEFAULT_TOPK_DEPTH;
+    g_conf.topk_num = DEFAULT_TOPK_NUM;
+    g_conf.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    g_conf.sort_memory_mb = 0;
+    g_conf.build_memory_mb = 0;
+    CONF_SET_STR_VALUE(tmp_dir, DEFAULT_TMP_DIR);
 }
 
 void check_conf()
@@ -316,6 +835,13 @@ void check_conf()
     CONF_PRINT_STR(chinese_map_file);
     CONF_PRINT_STR(input_rank_file);
     CONF_PRINT_STR(output_index_file);
+    CONF_PRINT_STR(output_pinyin_file);
+    printf("field topk_depth %d\n", g_conf.topk_depth);
+    printf("field topk_num %d\n", g_conf.topk_num);
+    printf("field threads %d\n", g_conf.threads);
+    printf("field sort_memory_mb %d\n", g_conf.sort_memory_mb);
+    printf("field build_memory_mb %d\n", g_conf.build_memory_mb);
+    CONF_PRINT_STR(tmp_dir);
 
     CONF_CHECK(chinese_map_file);
     CONF_CHECK(input_rank_file);
@@ -330,7 +856,7 @@ int main(int argc, char **argv)
     init_default_conf();
 
     /* arguments process */
-    while ((c = getopt(argc, argv, "C:I:O:h")) != -1)
+    while ((c = getopt(argc, argv, "C:I:O:B:D:N:j:M:S:T:h")) != -1)
     {
         switch (c)
         {
@@ -346,6 +872,27 @@ int main(int argc, char **argv)
             case 'O':
                 CONF_SET_STR_VALUE(output_index_file, optarg);
                 break;
+            case 'B':
+                CONF_SET_STR_VALUE(output_pinyin_file, optarg);
+                break;
+            case 'D':
+                g_conf.topk_depth = atoi(optarg);
+                break;
+            case 'N':
+                g_conf.topk_num = atoi(optarg);
+                break;
+            case 'j':
+                g_conf.threads = atoi(optarg);
+                break;
+            case 'M':
+                g_conf.build_memory_mb = atoi(optarg);
+                break;
+            case 'S':
+                g_conf.sort_memory_mb = atoi(optarg);
+                break;
+            case 'T':
+                CONF_SET_STR_VALUE(tmp_dir, optarg);
+                break;
             default:
                 usage();
         }
@@ -353,9 +900,15 @@ int main(int argc, char **argv)
 
     check_conf();
 
-    if (0 != read_chinese_map(g_conf.chinese_map_file, chinese_map))
+    if (0 != pinyin_map_load(g_conf.chinese_map_file, chinese_map))
+    {
+        printf("failed in pinyin_map_load\n");
+        return -1;
+    }
+    printf("pinyin map of %u codepoints, %u syllables in file %s\n", chinese_map.count, chinese_map.nsyllables, g_conf.chinese_map_file);
+    if (strlen(g_conf.output_pinyin_file) > 0 && 0 != pinyin_map_save(g_conf.output_pinyin_file, chinese_map))
     {
-        printf("failed in read_chinese_map\n");
+        printf("failed to write %s\n", g_conf.output_pinyin_file);
         return -1;
     }
 
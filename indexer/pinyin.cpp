@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <fstream>
+#include <map>
+
+#include "pinyin.h"
+#include "util.h"
+
+#define PINYIN_MAGIC "PYMP"
+#define PINYIN_VERSION 1
+#define PINYIN_HEADER_SIZE (4 + 6 * sizeof(uint32_t))
+
+uint32_t decode_utf8(const char *&p, const char *end)
+{
+    const unsigned char *s = reinterpret_cast<const unsigned char *>(p);
+    size_t len = getUTF8Len(p);
+    if (len == 0 || (size_t)(end - p) < len)
+    {
+        ++p;
+        return 0;
+    }
+
+    uint32_t cp;
+    switch (len)
+    {
+        case 1:
+            cp = s[0];
+            break;
+        case 2:
+            cp = s[0] & 0x1f;
+            break;
+        case 3:
+            cp = s[0] & 0x0f;
+            break;
+        default:
+            cp = s[0] & 0x07;
+            break;
+    }
+    for (size_t i = 1; i < len; ++i)
+    {
+        if ((s[i] & 0xc0) != 0x80)
+        {
+            ++p;
+            return 0;
+        }
+        cp = (cp << 6) | (s[i] & 0x3f);
+    }
+    p += len;
+    return cp;
+}
+
+//point the fields at the blob, after checking that it holds what the header says
+static int pinyin_map_bind(pinyin_map &map)
+{
+    const char *p = map.blob.empty() ? NULL : &map.blob[0];
+    size_t size = map.blob.size();
+    if (size < PINYIN_HEADER_SIZE || memcmp(p, PINYIN_MAGIC, 4) != 0)
+    {
+        return -1;
+    }
+
+    uint32_t header[6];
+    memcpy(header, p + 4, sizeof(header));
+    if (header[0] != PINYIN_VERSION)
+    {
+        return -1;
+    }
+    uint32_t nrefs = header[3];
+    uint64_t need = PINYIN_HEADER_SIZE
+                    + (uint64_t)(header[2] + 1) * sizeof(uint32_t)
+                    + (uint64_t)(nrefs + (nrefs & 1)) * sizeof(uint16_t)
+                    + (uint64_t)(header[4] + 1) * sizeof(uint32_t)
+                    + header[5];
+    if (need != size)
+    {
+        return -1;
+    }
+
+    map.first = header[1];
+    map.count = header[2];
+    map.nsyllables = header[4];
+    p += PINYIN_HEADER_SIZE;
+    map.slots = reinterpret_cast<const uint32_t *>(p);
+    p += (map.count + 1) * sizeof(uint32_t);
+    map.refs = reinterpret_cast<const uint16_t *>(p);
+    p += (nrefs + (nrefs & 1)) * sizeof(uint16_t);
+    map.syllables = reinterpret_cast<const uint32_t *>(p);
+    p += (map.nsyllables + 1) * sizeof(uint32_t);
+    map.text = p;
+
+    //every reference must name a syllable inside the text
+    for (uint32_t i = 0; i < nrefs; ++i)
+    {
+        if (map.refs[i] >= map.nsyllables)
+        {
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < map.count; ++i)
+    {
+        if (map.slots[i] > map.slots[i + 1] || map.slots[i + 1] > nrefs)
+        {
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < map.nsyllables; ++i)
+    {
+        if (map.syllables[i] > map.syllables[i + 1] || map.syllables[i + 1] > header[5])
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void blob_append(vector<char> &blob, const void *data, size_t size)
+{
+    blob.insert(blob.end(), (const char *)data, (const char *)data + size);
+}
+
+static int pinyin_map_parse(const char *file, pinyin_map &map)
+{
+    ifstream inf(file);
+    if (!inf.is_open())
+    {
+        return -1;
+    }
+
+    std::map<uint32_t, vector<uint16_t> > readings;
+    std::map<string, uint16_t> ids;
+    vector<string> syllables;
+    string strLine;
+    bool first_line = true;
+    while (getline(inf, strLine))
+    {
+        //the file may start with a utf8 byte order mark
+        if (first_line && strLine.compare(0, 3, "\xef\xbb\xbf") == 0)
+        {
+            strLine.erase(0, 3);
+        }
+        first_line = false;
+
+        strLine = trim(strLine, " \t\r", 1);
+        vector<string> vResult = sepstr(strLine, " ");
+        if (vResult.size() < 2)
+        {
+            continue;
+        }
+        const char *p = vResult[0].c_str();
+        const char *pEnd = p + vResult[0].size();
+        uint32_t cp = decode_utf8(p, pEnd);
+        if (cp == 0 || p != pEnd)
+        {
+            continue;
+        }
+
+        vector<uint16_t> &refs = readings[cp];
+        refs.clear();
+        for (size_t i = 1; i < vResult.size(); ++i)
+        {
+            std::map<string, uint16_t>::iterator it = ids.find(vResult[i]);
+            if (it == ids.end())
+            {
+                if (syllables.size() >= 0xffff)
+                {
+                    return -1;
+                }
+                it = ids.insert(make_pair(vResult[i], (uint16_t)syllables.size())).first;
+                syllables.push_back(vResult[i]);
+            }
+            refs.push_back(it->second);
+        }
+    }
+    if (readings.empty())
+    {
+        return -1;
+    }
+
+    uint32_t first = readings.begin()->first;
+    uint32_t count = readings.rbegin()->first - first + 1;
+    vector<uint32_t> slots(count + 1, 0);
+    vector<uint16_t> refs;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        slots[i] = refs.size();
+        std::map<uint32_t, vector<uint16_t> >::iterator it = readings.find(first + i);
+        if (it != readings.end())
+        {
+            refs.insert(refs.end(), it->second.begin(), it->second.end());
+        }
+    }
+    slots[count] = refs.size();
+    uint32_t nrefs = refs.size();
+    if (nrefs & 1)
+    {
+        refs.push_back(0);
+    }
+
+    string text;
+    vector<uint32_t> offsets;
+    for (size_t i = 0; i < syllables.size(); ++i)
+    {
+        offsets.push_back(text.size());
+        text.append(syllables[i]);
+    }
+    offsets.push_back(text.size());
+
+    uint32_t header[6] = {PINYIN_VERSION, first, count, nrefs, (uint32_t)syllables.size(), (uint32_t)text.size()};
+    map.blob.clear();
+    blob_append(map.blob, PINYIN_MAGIC, 4);
+    blob_append(map.blob, header, sizeof(header));
+    blob_append(map.blob, &slots[0], slots.size() * sizeof(uint32_t));
+    blob_append(map.blob, &refs[0], refs.size() * sizeof(uint16_t));
+    blob_append(map.blob, &offsets[0], offsets.size() * sizeof(uint32_t));
+    blob_append(map.blob, text.data(), text.size());
+    return pinyin_map_bind(map);
+}
+
+int pinyin_map_load(const char *file, pinyin_map &map)
+{
+    ifstream inf(file, ios::binary);
+    if (!inf.is_open())
+    {
+        return -1;
+    }
+    char magic[4] = {0};
+    inf.read(magic, sizeof(magic));
+    if (!inf || memcmp(magic, PINYIN_MAGIC, 4) != 0)
+    {
+        inf.close();
+        return pinyin_map_parse(file, map);
+    }
+
+    inf.seekg(0, ios::end);
+    size_t size = inf.tellg();
+    inf.seekg(0, ios::beg);
+    map.blob.resize(size);
+    inf.read(&map.blob[0], size);
+    if (!inf)
+    {
+        return -1;
+    }
+    return pinyin_map_bind(map);
+}
+
+int pinyin_map_save(const char *file, const pinyin_map &map)
+{
+    ofstream ofs(file, ios::binary);
+    if (!ofs.is_open() || map.blob.empty())
+    {
+        return -1;
+    }
+    ofs.write(&map.blob[0], map.blob.size());
+    return ofs ? 0 : -1;
+}
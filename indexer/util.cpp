@@ -504,6 +504,27 @@ int mysleep_sec(unsigned int second)
     return 0;
 }
 
+static int g_thread_slots = 0;
+static __thread int t_thread_slot = -1;
+
+int get_thread_slot()
+{
+    if (t_thread_slot < 0)
+    {
+        if (g_thread_slots >= MAX_THREAD_SLOTS)
+        {
+            return -1;
+        }
+        int slot = __sync_fetch_and_add(&g_thread_slots, 1);
+        if (slot >= MAX_THREAD_SLOTS)
+        {
+            return -1;
+        }
+        t_thread_slot = slot;
+    }
+    return t_thread_slot;
+}
+
 int mysleep_millisec(unsigned int millisecond)
 {
     struct timeval t_timeval;
@@ -112,6 +112,15 @@ int mkdir_recursive(const char *pathname, mode_t mode);
 int mysleep_sec(unsigned int second);
 int mysleep_millisec(unsigned int millisecond);
 
+#define MAX_THREAD_SLOTS 256
+
+/*
+    get a small id of the calling thread, in [0, MAX_THREAD_SLOTS).
+    ids are handed out on first use and never reused.
+    return -1 when all of them are taken.
+*/
+int get_thread_slot();
+
 string trimright(const string &sStr, const string &s, bool bChar);
 string trimleft(const string &sStr, const string &s, bool bChar);
 string trim(const string &sStr, const string &s, bool bChar);
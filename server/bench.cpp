@@ -0,0 +1,333 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <new>
+#include <algorithm>
+
+#include "prefixmatch.h"
+#include "cache.h"
+#include "config.h"
+#include "stats.h"
+
+/*
+ * Replays a query log against the engine, without the network: every
+ * thread runs all the queries, from its own offset, for some rounds.
+ * Reports the latency distribution, the throughput, the allocations of
+ * operator new and, where perf_event_open is allowed, the cache misses
+ * per query. -j prints one JSON object instead, for tracking regressions.
+ *
+ * make bench
+ * ./bench -t 4 -n 10 chinese index queries
+ * ./bench -p ../indexer/input chinese index    (every prefix of every key)
+ */
+
+#define MAX_BENCH_THREADS 128
+
+typedef struct bench_thread
+{
+    pthread_t thread;
+    int id;
+    vector<uint64_t> latencies; /* ns of every query */
+    uint64_t failures;
+    uint64_t allocs;
+    int64_t cache_misses;       /* -1 when they can not be counted */
+} bench_thread;
+
+static vector<string> g_queries;
+static int g_rounds = 1;
+static int g_number = 10;
+static int g_nthreads = 1;
+static pthread_barrier_t g_start;
+
+static __thread uint64_t t_allocs = 0;
+
+void *operator new(size_t size)
+{
+    t_allocs++;
+    void *p = malloc(size > 0 ? size : 1);
+    if (p == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+static int open_cache_misses()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void *bench_main(void *arg)
+{
+    bench_thread *me = (bench_thread *)arg;
+    size_t nqueries = g_queries.size();
+    size_t offset = nqueries * me->id / g_nthreads;
+    query_result res;
+
+    me->latencies.reserve(nqueries * g_rounds);
+    int perf_fd = open_cache_misses();
+
+    pthread_barrier_wait(&g_start);
+    if (perf_fd >= 0)
+    {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    uint64_t allocs = t_allocs;
+    for (int r = 0; r < g_rounds; r++)
+    {
+        for (size_t i = 0; i < nqueries; i++)
+        {
+            const string &query = g_queries[(offset + i) % nqueries];
+            uint64_t start = stats_now();
+            if (Get(query, g_number, res) != 0)
+            {
+                me->failures++;
+            }
+            Release(res);
+            me->latencies.push_back(stats_now() - start);
+        }
+    }
+    me->allocs = t_allocs - allocs;
+
+    me->cache_misses = -1;
+    if (perf_fd >= 0)
+    {
+        uint64_t misses;
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &misses, sizeof(misses)) == sizeof(misses))
+        {
+            me->cache_misses = misses;
+        }
+        close(perf_fd);
+    }
+    return NULL;
+}
+
+/*
+ * a query per line, or with prefixes every prefix of the key before the tab.
+ * Lines longer than a keyword are skipped, the server would not take them.
+ */
+static int load_queries(const char *file, bool prefixes)
+{
+    FILE *fp = fopen(file, "r");
+    if (fp == NULL)
+    {
+        printf("can not open %s\n", file);
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t nread;
+    size_t skipped = 0;
+    while ((nread = getline(&line, &cap, fp)) != -1)
+    {
+        size_t len = strcspn(line, prefixes ? "\t\r\n" : "\r\n");
+        if (len == 0)
+        {
+            continue;
+        }
+        if (len >= MAX_KEYWORD_LENGTH)
+        {
+            skipped++;
+            continue;
+        }
+        if (!prefixes)
+        {
+            g_queries.push_back(string(line, len));
+            continue;
+        }
+        for (size_t i = 1; i <= len; i++)
+        {
+            //only whole utf-8 characters
+            if (i == len || ((unsigned char)line[i] & 0xC0) != 0x80)
+            {
+                g_queries.push_back(string(line, i));
+            }
+        }
+    }
+    free(line);
+    fclose(fp);
+    if (skipped > 0)
+    {
+        fprintf(stderr, "skipped %zu lines longer than %d bytes\n", skipped, MAX_KEYWORD_LENGTH - 1);
+    }
+    return 0;
+}
+
+static double percentile_us(const vector<uint64_t> &sorted, double q)
+{
+    size_t i = (size_t)(q * sorted.size());
+    return sorted[min(i, sorted.size() - 1)] / 1000.0;
+}
+
+static void usage()
+{
+    printf("usage: bench [-t threads] [-n rounds] [-k number] [-c cache_mb] [-j] [-p input] py_file index_file [query_file]\n"
+           "  -t  threads replaying the queries (default: 1)\n"
+           "  -n  times every thread replays them (default: 1)\n"
+           "  -k  items asked for by a query (default: 10)\n"
+           "  -c  query cache in MB (default: 0, every query runs on the trie)\n"
+           "  -j  print the results as one JSON object\n"
+           "  -p  queries are the prefixes of the keys of an indexer input file\n");
+}
+
+int main(int argc, char **argv)
+{
+    int cache_mb = 0;
+    bool json = false;
+    const char *input = NULL;
+    int c;
+
+    while (-1 != (c = getopt(argc, argv, "t:n:k:c:jp:")))
+    {
+        switch (c)
+        {
+        case 't':
+            g_nthreads = atoi(optarg);
+            break;
+        case 'n':
+            g_rounds = atoi(optarg);
+            break;
+        case 'k':
+            g_number = atoi(optarg);
+            break;
+        case 'c':
+            cache_mb = atoi(optarg);
+            break;
+        case 'j':
+            json = true;
+            break;
+        case 'p':
+            input = optarg;
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if (argc - optind != (input ? 2 : 3) || g_nthreads < 1 || g_nthreads > MAX_BENCH_THREADS || g_rounds < 1)
+    {
+        usage();
+        return -1;
+    }
+
+    settings_init();
+    if (load_queries(input ? input : argv[optind + 2], input != NULL) != 0)
+    {
+        return -1;
+    }
+    if (g_queries.empty())
+    {
+        printf("no queries\n");
+        return -1;
+    }
+    cache_init((size_t)cache_mb << 20);
+    if (Init_Index(argv[optind], argv[optind + 1]) != 0)
+    {
+        printf("init index error\n");
+        return -1;
+    }
+
+    //fault the index in before the clock starts
+    query_result res;
+    for (size_t i = 0; i < g_queries.size(); i++)
+    {
+        Get(g_queries[i], g_number, res);
+        Release(res);
+    }
+
+    bench_thread *threads = new bench_thread[g_nthreads];
+    pthread_barrier_init(&g_start, NULL, g_nthreads + 1);
+    for (int i = 0; i < g_nthreads; i++)
+    {
+        threads[i].id = i;
+        threads[i].failures = 0;
+        if (pthread_create(&threads[i].thread, NULL, bench_main, &threads[i]) != 0)
+        {
+            printf("can not create thread %d\n", i);
+            return -1;
+        }
+    }
+    pthread_barrier_wait(&g_start);
+    uint64_t start = stats_now();
+    for (int i = 0; i < g_nthreads; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+    }
+    double seconds = (stats_now() - start) / 1e9;
+
+    vector<uint64_t> latencies;
+    uint64_t failures = 0, allocs = 0, total_ns = 0;
+    int64_t cache_misses = 0;
+    for (int i = 0; i < g_nthreads; i++)
+    {
+        bench_thread *t = &threads[i];
+        latencies.insert(latencies.end(), t->latencies.begin(), t->latencies.end());
+        failures += t->failures;
+        allocs += t->allocs;
+        cache_misses = (cache_misses < 0 || t->cache_misses < 0) ? -1 : cache_misses + t->cache_misses;
+    }
+    sort(latencies.begin(), latencies.end());
+    for (size_t i = 0; i < latencies.size(); i++)
+    {
+        total_ns += latencies[i];
+    }
+    size_t n = latencies.size();
+
+    if (json)
+    {
+        printf("{\"threads\":%d,\"rounds\":%d,\"queries\":%zu,\"failures\":%" PRIu64 ",\"seconds\":%.3f,"
+               "\"qps\":%.1f,\"mean_us\":%.2f,\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,"
+               "\"p999_us\":%.2f,\"max_us\":%.2f,\"allocs_per_query\":%.2f,",
+               g_nthreads, g_rounds, n, failures, seconds, n / seconds, total_ns / 1000.0 / n,
+               percentile_us(latencies, 0.5), percentile_us(latencies, 0.9), percentile_us(latencies, 0.99),
+               percentile_us(latencies, 0.999), latencies[n - 1] / 1000.0, (double)allocs / n);
+        if (cache_misses >= 0)
+        {
+            printf("\"cache_misses_per_query\":%.2f}\n", (double)cache_misses / n);
+        }
+        else
+        {
+            printf("\"cache_misses_per_query\":null}\n");
+        }
+        return 0;
+    }
+
+    printf("queries: %zu (%d threads x %d rounds x %zu), failures: %" PRIu64 "\n",
+           n, g_nthreads, g_rounds, g_queries.size(), failures);
+    printf("throughput: %.1f queries/s in %.3fs\n", n / seconds, seconds);
+    printf("latency: mean %.2fus, p50 %.2fus, p90 %.2fus, p99 %.2fus, p999 %.2fus, max %.2fus\n",
+           total_ns / 1000.0 / n, percentile_us(latencies, 0.5), percentile_us(latencies, 0.9),
+           percentile_us(latencies, 0.99), percentile_us(latencies, 0.999), latencies[n - 1] / 1000.0);
+    printf("allocations per query: %.2f\n", (double)allocs / n);
+    if (cache_misses >= 0)
+    {
+        printf("cache misses per query: %.2f\n", (double)cache_misses / n);
+    }
+    else
+    {
+        printf("cache misses per query: n/a, perf_event_open is not allowed\n");
+    }
+    return 0;
+}
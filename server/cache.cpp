@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <unordered_map>
+
+#include "cache.h"
+#include "log.h"
+
+#define CACHE_SHARDS 16
+
+struct cache_entry
+{
+    string key;
+    uint64_t generation;
+    int refcount;               /* one for the shard, one for each reader */
+    size_t bytes;
+    vector<result_item> items;  /* the names point into names */
+    char *names;
+    cache_entry *prev;          /* LRU list, the head is the most recent */
+    cache_entry *next;
+};
+
+typedef unordered_map<string, cache_entry *> entryMap;
+
+typedef struct cache_shard
+{
+    pthread_mutex_t lock;
+    entryMap entries;
+    cache_entry *head;
+    cache_entry *tail;
+    size_t bytes;
+    size_t max_bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+} cache_shard;
+
+static cache_shard *g_shards = NULL;
+
+static cache_shard *shard_of(const string &key)
+{
+    return &g_shards[std::hash<string>()(key) % CACHE_SHARDS];
+}
+
+static void entry_free(cache_entry *entry)
+{
+    free(entry->names);
+    delete entry;
+}
+
+static void entry_unref(cache_entry *entry)
+{
+    if (__sync_sub_and_fetch(&entry->refcount, 1) == 0)
+    {
+        entry_free(entry);
+    }
+}
+
+static void lru_unlink(cache_shard *shard, cache_entry *entry)
+{
+    if (entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        shard->head = entry->next;
+    }
+    if (entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        shard->tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+}
+
+static void lru_push_front(cache_shard *shard, cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head)
+    {
+        shard->head->prev = entry;
+    }
+    shard->head = entry;
+    if (shard->tail == NULL)
+    {
+        shard->tail = entry;
+    }
+}
+
+//remove an entry from the shard, with the shard locked
+static void shard_remove(cache_shard *shard, cache_entry *entry)
+{
+    lru_unlink(shard, entry);
+    shard->entries.erase(entry->key);
+    shard->bytes -= entry->bytes;
+    entry_unref(entry);
+}
+
+int cache_init(size_t max_bytes)
+{
+    if (max_bytes == 0)
+    {
+        log_debug(LOG_NOTICE, "the query cache is disabled\n");
+        return 0;
+    }
+
+    g_shards = new cache_shard[CACHE_SHARDS];
+    for (int i = 0; i < CACHE_SHARDS; ++i)
+    {
+        cache_shard *shard = &g_shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->head = shard->tail = NULL;
+        shard->bytes = 0;
+        shard->max_bytes = max_bytes / CACHE_SHARDS;
+        shard->hits = shard->misses = shard->inserts = shard->evictions = 0;
+    }
+    log_debug(LOG_NOTICE, "the query cache uses at most %zu bytes\n", max_bytes);
+    return 0;
+}
+
+void cache_deinit()
+{
+    if (g_shards == NULL)
+    {
+        return;
+    }
+    cache_clear();
+    for (int i = 0; i < CACHE_SHARDS; ++i)
+    {
+        pthread_mutex_destroy(&g_shards[i].lock);
+    }
+    delete [] g_shards;
+    g_shards = NULL;
+}
+
+cache_entry *cache_get(const string &key, uint64_t generation, vector<result_item> &items)
+{
+    if (g_shards == NULL)
+    {
+        return NULL;
+    }
+
+    cache_shard *shard = shard_of(key);
+    cache_entry *entry = NULL;
+    pthread_mutex_lock(&shard->lock);
+    entryMap::iterator it = shard->entries.find(key);
+    if (it != shard->entries.end())
+    {
+        if (it->second->generation == generation)
+        {
+            entry = it->second;
+            __sync_add_and_fetch(&entry->refcount, 1);
+            lru_unlink(shard, entry);
+            lru_push_front(shard, entry);
+        }
+        else
+        {
+            //computed from an index which has been replaced
+            shard_remove(shard, it->second);
+        }
+    }
+    if (entry)
+    {
+        ++shard->hits;
+    }
+    else
+    {
+        ++shard->misses;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (entry)
+    {
+        items = entry->items;
+    }
+    return entry;
+}
+
+void cache_set(const string &key, uint64_t generation, const vector<result_item> &items)
+{
+    if (g_shards == NULL)
+    {
+        return;
+    }
+
+    size_t names_size = 0;
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+        names_size += items[i].length;
+    }
+    size_t bytes = sizeof(cache_entry) + key.size() + names_size + items.size() * sizeof(result_item);
+
+    cache_shard *shard = shard_of(key);
+    if (bytes > shard->max_bytes)
+    {
+        return;
+    }
+
+    //copy the names out of the index, then point the items at the copies
+    cache_entry *entry = new cache_entry;
+    entry->key = key;
+    entry->generation = generation;
+    entry->refcount = 1;
+    entry->bytes = bytes;
+    entry->items = items;
+    entry->names = (char *)malloc(names_size > 0 ? names_size : 1);
+    entry->prev = entry->next = NULL;
+    char *p = entry->names;
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+        memcpy(p, items[i].name, items[i].length);
+        entry->items[i].name = p;
+        p += items[i].length;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    entryMap::iterator it = shard->entries.find(key);
+    if (it != shard->entries.end())
+    {
+        shard_remove(shard, it->second);
+    }
+    while (shard->tail && shard->bytes + bytes > shard->max_bytes)
+    {
+        shard_remove(shard, shard->tail);
+        ++shard->evictions;
+    }
+    shard->entries[key] = entry;
+    lru_push_front(shard, entry);
+    shard->bytes += bytes;
+    ++shard->inserts;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_release(cache_entry *entry)
+{
+    if (entry)
+    {
+        entry_unref(entry);
+    }
+}
+
+void cache_clear()
+{
+    if (g_shards == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < CACHE_SHARDS; ++i)
+    {
+        cache_shard *shard = &g_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        while (shard->head)
+        {
+            shard_remove(shard, shard->head);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void cache_get_stats(cache_stats &stats)
+{
+    memset(&stats, 0, sizeof(stats));
+    if (g_shards == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < CACHE_SHARDS; ++i)
+    {
+        cache_shard *shard = &g_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats.hits += shard->hits;
+        stats.misses += shard->misses;
+        stats.inserts += shard->inserts;
+        stats.evictions += shard->evictions;
+        stats.entries += shard->entries.size();
+        stats.bytes += shard->bytes;
+        stats.max_bytes += shard->max_bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef __QUERY_CACHE_H__
+#define __QUERY_CACHE_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "prefixmatch.h"
+
+using namespace std;
+
+/*
+ * A cache of query results in front of the trie, split into shards which
+ * are LRU lists of their own. An entry keeps its own copy of the names, so
+ * a hit does not touch the index, and it is tagged with the index
+ * generation it was computed from: entries of an older generation are
+ * never returned.
+ */
+typedef struct cache_entry cache_entry;
+
+typedef struct cache_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    uint64_t entries;
+    uint64_t bytes;
+    uint64_t max_bytes;
+} cache_stats;
+
+/* max_bytes is the memory budget of all shards, 0 disables the cache */
+int cache_init(size_t max_bytes);
+void cache_deinit();
+
+/*
+ * Looks up a key of the given generation. On a hit the items point into
+ * the entry, which is pinned until cache_release().
+ * return NULL on a miss.
+ */
+cache_entry *cache_get(const string &key, uint64_t generation, vector<result_item> &items);
+
+/* stores a copy of the items */
+void cache_set(const string &key, uint64_t generation, const vector<result_item> &items);
+
+void cache_release(cache_entry *entry);
+
+/* drops every entry, pinned ones are freed on their last release */
+void cache_clear();
+
+void cache_get_stats(cache_stats &stats);
+
+#endif
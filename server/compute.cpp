@@ -0,0 +1,192 @@
+#include <string.h>
+#include <pthread.h>
+
+#include <deque>
+
+#include "compute.h"
+#include "log.h"
+
+using namespace std;
+
+typedef struct compute_job
+{
+    compute_fn run;
+    void *arg;
+} compute_job;
+
+typedef struct executor
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    deque<compute_job> jobs;
+    int size;   /* jobs.size(), read without the lock to skip empty deques */
+    int idle;   /* set by the executor before it sleeps, cleared by whoever wakes it */
+    bool wake;  /* under lock, the executor was woken */
+} executor;
+
+static executor *g_executors = NULL;
+static int g_nexecutors = 0;
+static int g_idle = 0;  /* executors with idle set */
+
+static bool executor_take(executor *e, compute_job &job)
+{
+    if (__atomic_load_n(&e->size, __ATOMIC_RELAXED) == 0)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&e->lock);
+    bool found = !e->jobs.empty();
+    if (found)
+    {
+        job = e->jobs.front();
+        e->jobs.pop_front();
+        __atomic_store_n(&e->size, (int)e->jobs.size(), __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return found;
+}
+
+//our own deque first, then steal from the next ones
+static bool executor_find(int self, compute_job &job)
+{
+    for (int i = 0; i < g_nexecutors; i++)
+    {
+        if (executor_take(&g_executors[(self + i) % g_nexecutors], job))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//true if e was idle and is now ours to wake
+static bool executor_claim(executor *e)
+{
+    if (!__sync_bool_compare_and_swap(&e->idle, 1, 0))
+    {
+        return false;
+    }
+    __sync_sub_and_fetch(&g_idle, 1);
+    return true;
+}
+
+static void executor_wake(executor *e)
+{
+    pthread_mutex_lock(&e->lock);
+    e->wake = true;
+    pthread_cond_signal(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+}
+
+static void *executor_main(void *arg)
+{
+    executor *e = (executor *)arg;
+    int self = e - g_executors;
+    compute_job job;
+
+    while (true)
+    {
+        if (executor_find(self, job))
+        {
+            job.run(job.arg);
+            continue;
+        }
+
+        /*
+         * Say we are idle, then look once more: a submit either sees us
+         * idle and wakes us, or pushed its job before we looked.
+         */
+        __atomic_store_n(&e->idle, 1, __ATOMIC_SEQ_CST);
+        __sync_add_and_fetch(&g_idle, 1);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (executor_find(self, job))
+        {
+            //when the claim fails a wake is on its way, it only costs a loop
+            executor_claim(e);
+            job.run(job.arg);
+            continue;
+        }
+
+        pthread_mutex_lock(&e->lock);
+        while (!e->wake)
+        {
+            pthread_cond_wait(&e->cond, &e->lock);
+        }
+        e->wake = false;
+        pthread_mutex_unlock(&e->lock);
+    }
+    return NULL;
+}
+
+int compute_init(int nthreads)
+{
+    if (nthreads <= 0)
+    {
+        return 0;
+    }
+
+    g_executors = new executor[nthreads];
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_mutex_init(&g_executors[i].lock, NULL);
+        pthread_cond_init(&g_executors[i].cond, NULL);
+        g_executors[i].size = 0;
+        g_executors[i].idle = 0;
+        g_executors[i].wake = false;
+    }
+    g_nexecutors = nthreads;
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int ret = pthread_create(&thread, &attr, executor_main, &g_executors[i]);
+        pthread_attr_destroy(&attr);
+        if (ret != 0)
+        {
+            log_debug(LOG_ERR, "Can't create compute thread: %s\n", strerror(ret));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+bool compute_enabled()
+{
+    return g_nexecutors > 0;
+}
+
+void compute_submit(int home, compute_fn run, void *arg)
+{
+    compute_job job = {run, arg};
+    executor *e = &g_executors[home % g_nexecutors];
+
+    pthread_mutex_lock(&e->lock);
+    e->jobs.push_back(job);
+    __atomic_store_n(&e->size, (int)e->jobs.size(), __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&e->lock);
+
+    //wake the home executor if it sleeps, or else any sleeping one to steal the job
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (executor_claim(e))
+    {
+        executor_wake(e);
+        return;
+    }
+    if (__atomic_load_n(&g_idle, __ATOMIC_SEQ_CST) == 0)
+    {
+        return;
+    }
+    for (int i = 1; i < g_nexecutors; i++)
+    {
+        executor *other = &g_executors[(home + i) % g_nexecutors];
+        if (executor_claim(other))
+        {
+            executor_wake(other);
+            return;
+        }
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef __COMPUTE_H__
+#define __COMPUTE_H__
+
+/*
+ * A pool of executor threads running queries off the libevent workers, so
+ * a slow query only holds up its own connection. Every executor has a
+ * deque of jobs under its own lock, and a worker submits to the executor
+ * it maps to. An executor takes the oldest job of its own and, when that
+ * is empty, steals one from the others before it sleeps. The job itself
+ * tells its libevent worker when it is done.
+ */
+typedef void (*compute_fn)(void *arg);
+
+/* starts nthreads executors, 0 leaves the pool off */
+int compute_init(int nthreads);
+
+/* whether there are executors to submit to */
+bool compute_enabled();
+
+/* queues a job on the executor of the worker home, any of them may run it */
+void compute_submit(int home, compute_fn run, void *arg);
+
+#endif
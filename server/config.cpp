@@ -18,16 +18,26 @@ void settings_init(void)
     g_settings.log_path = NULL;
 
     g_settings.port = LISTEN_PORT;
+    g_settings.udpport = 0;
+    g_settings.num_threads_per_udp = 0;  /* one per worker */
     g_settings.maxconns = 1024;         /* to limit connections-related memory to about 5MB */
     g_settings.verbose = 0;
     g_settings.socketpath = NULL;       /* by default, not using a unix socket */
     g_settings.num_threads = 4;         /* N workers */
+    g_settings.reuseport = 0;
+    g_settings.compute_threads = 0;
     g_settings.reqs_per_event = 20;
     g_settings.backlog = 1024;
     g_settings.index_path = NULL;
     g_settings.chinese_map_file = NULL;
     g_settings.max_depth = 1024;
+    g_settings.max_expansions = 256;
+    g_settings.cache_size = 64;
+    g_settings.max_response_size = 1 << 20;
+    g_settings.request_timeout = 0;
+    g_settings.log_deferred = 0;
     g_settings.monitor_timeout = 10;
+    g_settings.monitor_threads = 2;
 }
 
 void parse_config()
@@ -90,19 +100,29 @@ void parse_config()
 
         set_config_str("unixpath", socketpath);
         set_config_int("port", port);
+        set_config_int("udp_port", udpport);
+        set_config_int("udp_threads", num_threads_per_udp);
         set_config_int("verbose", verbose);
         set_config_int("maxconn", maxconns);
         set_config_int("verbose", verbose);
         set_config_int("threads", num_threads);
+        set_config_int("reuseport", reuseport);
+        set_config_int("compute_threads", compute_threads);
         set_config_int("backlog", backlog);
         set_config_int("max_requests", reqs_per_event);
         set_config_str("chinese_map_file", chinese_map_file);
         set_config_str("index_file", index_path);
         set_config_int("max_depth", max_depth);
+        set_config_int("max_expansions", max_expansions);
+        set_config_int("cache_size", cache_size);
+        set_config_int("max_response_size", max_response_size);
+        set_config_int("request_timeout", request_timeout);
         set_config_str("log_path", log_path);
         set_config_str("log_level", log_level);
+        set_config_int("log_deferred", log_deferred);
         set_config_short("monitor_port", monitor_port);
         set_config_int("monitor_timeout", monitor_timeout);
+        set_config_int("monitor_threads", monitor_threads);
     }
 
     fclose(fp);
@@ -119,18 +139,28 @@ void output_settings(settings *pset)
 
     printf("maxconns: %d\n", g_settings.maxconns);
     printf("tcpport: %d\n", g_settings.port);
+    printf("udpport: %d\n", g_settings.udpport);
+    printf("num_threads_per_udp: %d\n", g_settings.num_threads_per_udp);
     printf("verbosity: %d\n", g_settings.verbose);
     printf("domain_socket: %s\n", g_settings.socketpath ? g_settings.socketpath : "NULL");
     printf("umask: %o\n", g_settings.access);
     printf("num_threads: %d\n", g_settings.num_threads);
+    printf("reuseport: %d\n", g_settings.reuseport);
+    printf("compute_threads: %d\n", g_settings.compute_threads);
     printf("tcp_backlog: %d\n", g_settings.backlog);
     printf("py_file: %s\n", g_settings.chinese_map_file);
     printf("index_file: %s\n", g_settings.index_path);
     printf("max_depth: %d\n", g_settings.max_depth);
+    printf("max_expansions: %d\n", g_settings.max_expansions);
+    printf("cache_size: %dMB\n", g_settings.cache_size);
+    printf("max_response_size: %d\n", g_settings.max_response_size);
+    printf("request_timeout: %dms\n", g_settings.request_timeout);
     printf("log_path: %s\n", g_settings.log_path);
     printf("log_level: %s\n", g_settings.log_level);
+    printf("log_deferred: %d\n", g_settings.log_deferred);
     printf("monitor port: %d\n", g_settings.monitor_port);
     printf("monitor_timeout: %d\n", g_settings.monitor_timeout);
+    printf("monitor_threads: %d\n", g_settings.monitor_threads);
 }
 
 int check_settings()
@@ -19,10 +19,13 @@ typedef struct settings
     //network settings
     int maxconns;
     int port; /* listen port*/
+    int udpport; /* udp listen port, 0 is off */
     char *socketpath; /* path to unix socket if using local socket */
     int access;  /* access mask (a la chmod) for unix domain socket */
     int num_threads;        /* number of worker (without dispatcher) libevent threads to run */
     int num_threads_per_udp; /* number of worker threads serving each udp socket */
+    int reuseport;          /* every worker accepts on its own SO_REUSEPORT socket */
+    int compute_threads;    /* threads running the queries, 0 runs them on the workers */
     char prefix_delimiter;  /* character that marks a key prefix (for stats) */
     int reqs_per_event;     /* Maximum number of io to process on each io-event. */
     int backlog;
@@ -32,14 +35,20 @@ typedef struct settings
     char *index_path;
     char *chinese_map_file;
     int max_depth;
+    int max_expansions;     /* max number of pinyin syllables tried for a query */
+    int cache_size;         /* memory of the query cache in MB, 0 disables it */
+    int max_response_size;  /* max bytes of a binary reply body, the items past it are left out */
+    int request_timeout;    /* ms a request may take unless it sets its own, 0 for no limit */
 
     //logs
     char *log_path;
     char *log_level;
+    int log_deferred;       /* workers log the raw arguments, the log thread formats them */
 
     //monitor
     unsigned short monitor_port;
     int monitor_timeout;
+    int monitor_threads;    /* threads serving the monitor, each with an event base of its own */
 } settings;
 
 extern pthread_rwlock_t g_rwsetlock;
@@ -47,6 +47,14 @@ conn *conn_from_freelist()
     return c;
 }
 
+/*
+ * Connections in the freelist, read without the lock for the monitor.
+ */
+int conn_freelist_size()
+{
+    return __atomic_load_n(&freecurr, __ATOMIC_RELAXED);
+}
+
 /*
  * Adds a connection to the freelist. 0 = success.
  */
@@ -92,12 +100,14 @@ conn *conn_new(const int sfd, enum conn_states init_state,
         }
 
         c->rbuf = c->wbuf = 0;
+        c->abuf = 0;
         c->iov = 0;
         c->msglist = 0;
         c->hdrbuf = 0;
 
         c->rsize = read_buffer_size;
         c->wsize = DATA_BUFFER_SIZE;
+        c->asize = 0;
         c->iovsize = IOV_LIST_INITIAL;
         c->msgsize = MSG_LIST_INITIAL;
         c->hdrsize = 0;
@@ -203,6 +213,10 @@ void conn_free(conn *c)
         {
             free(c->wbuf);
         }
+        if (c->abuf)
+        {
+            free(c->abuf);
+        }
         if (c->iov)
         {
             free(c->iov);
@@ -224,9 +238,14 @@ void conn_close(conn *c)
     }
 
     close(c->sfd);
-    pthread_mutex_lock(&conn_lock);
-    do_accept_new_conns(true);
-    pthread_mutex_unlock(&conn_lock);
+    if (c->thread != NULL && !IS_UDP(c->transport))
+    {
+        __sync_sub_and_fetch(&c->thread->active_conns, 1);
+    }
+    if (!allow_new_conns)
+    {
+        accept_new_conns(true);
+    }
     conn_cleanup(c);
 
     /* if the connection has big buffers, just free it */
@@ -249,6 +268,12 @@ void conn_close(conn *c)
 void conn_shrink(conn *c)
 {
     assert(c != NULL);
+
+    /* a UDP conn keeps its buffer big enough for any datagram */
+    if (IS_UDP(c->transport))
+    {
+        return;
+    }
     if (c->rsize > READ_BUFFER_HIGHWAT && c->rbytes < DATA_BUFFER_SIZE)
     {
         char *newbuf;
@@ -269,6 +294,13 @@ void conn_shrink(conn *c)
         c->rcurr = c->rbuf;
     }
 
+    if (c->asize > REPLY_BUFFER_HIGHWAT)
+    {
+        free(c->abuf);
+        c->abuf = 0;
+        c->asize = 0;
+    }
+
     if (c->msgsize > MSG_LIST_HIGHWAT)
     {
         struct msghdr *newbuf = (struct msghdr *) realloc((void *)c->msglist, MSG_LIST_INITIAL * sizeof(c->msglist[0]));
@@ -292,6 +324,27 @@ void conn_shrink(conn *c)
     }
 }
 
+char *conn_reply_buffer(conn *c, int size)
+{
+    assert(c != NULL);
+    if (size > c->asize)
+    {
+        int nsize = c->asize > 0 ? c->asize : DATA_BUFFER_SIZE;
+        while (nsize < size)
+        {
+            nsize *= 2;
+        }
+        char *newbuf = (char *)realloc(c->abuf, nsize);
+        if (newbuf == NULL)
+        {
+            return NULL;
+        }
+        c->abuf = newbuf;
+        c->asize = nsize;
+    }
+    return c->abuf;
+}
+
 /**
  * Convert a state name to a human readable form.
  */
@@ -306,7 +359,8 @@ static const char *state_text(enum conn_states state)
                                        "conn_nread",
                                        "conn_swallow",
                                        "conn_closing",
-                                       "conn_mwrite"
+                                       "conn_mwrite",
+                                       "conn_compute"
                                      };
     return statenames[state];
 }
@@ -27,6 +27,9 @@ struct conn
     int    wsize;
     int    wbytes;
 
+    char   *abuf;   /** reply bodies are built here, kept across requests */
+    int    asize;   /** total allocated size of abuf */
+
     /** which state to go into after finishing current write */
     enum conn_states  write_and_go;
     void   *write_and_free; /** free this memory after finishing writing */
@@ -52,7 +55,7 @@ struct conn
 
     /* data for UDP clients */
     int    request_id; /* Incoming UDP request ID, if this is a UDP "connection" */
-    struct sockaddr request_addr; /* Who sent the most recent request */
+    struct sockaddr_storage request_addr; /* Who sent the most recent request, v4 or v6 */
     socklen_t request_addr_size;
     unsigned char *hdrbuf; /* udp packet headers */
     int    hdrsize;   /* number of headers' worth of space is allocated */
@@ -63,6 +66,7 @@ struct conn
     /* This is where the binary header goes */
     request_header binary_header;
     short cmd; /* current command being processed */
+    uint64_t deadline; /* monotonic_msec() the queries of the command stop at, 0 for none */
     conn   *next;     /* Used for generating a list of conn structures */
     LIBEVENT_THREAD *thread; /* Pointer to the thread object serving this connection */
 };
@@ -72,6 +76,7 @@ struct conn
 
 conn *conn_from_freelist(void);
 bool  conn_add_to_freelist(conn *c);
+int   conn_freelist_size(void);
 
 conn *conn_new(const int sfd, const enum conn_states init_state,
                const int event_flags, const int read_buffer_size,
@@ -82,6 +87,12 @@ void conn_free(conn *c);
 void conn_close(conn *c);
 
 void conn_shrink(conn *c);
+
+/*
+ * Returns the buffer of the connection to build a reply body of size bytes
+ * in, valid until the reply has been written. NULL if out of memory.
+ */
+char *conn_reply_buffer(conn *c, int size);
 void conn_cleanup(conn *c);
 
 void conn_set_state(conn *c, enum conn_states state);
@@ -47,6 +47,7 @@ enum conn_states
     conn_swallow,    /**< swallowing unnecessary bytes w/o storing */
     conn_closing,    /**< closing this connection */
     conn_mwrite,     /**< writing out many items sequentially */
+    conn_compute,    /**< the request is handed to the compute pool */
     conn_max_state   /**< Max state value (used for assertion) */
 };
 
@@ -57,6 +58,8 @@ enum network_transport
     udp_transport
 };
 
+#define IS_UDP(x) (x == udp_transport)
+
 /** Maximum length of a key. */
 #define KEY_MAX_LENGTH 250
 
@@ -77,6 +80,7 @@ enum network_transport
 
 /** High water marks for buffer shrinking */
 #define READ_BUFFER_HIGHWAT 8192
+#define REPLY_BUFFER_HIGHWAT 65536
 #define ITEM_LIST_HIGHWAT 400
 #define IOV_LIST_HIGHWAT 600
 #define MSG_LIST_HIGHWAT 100
@@ -116,16 +120,29 @@ extern "C"
     typedef enum
     {
         RESPONSE_SUCCESS = 0x00,
+        RESPONSE_EINVAL = 0x04,
+        RESPONSE_PARTIAL = 0x05,
+        RESPONSE_UNKNOWN_COMMAND = 0x81,
         RESPONSE_ENOMEM = 0x82
     } response_status;
 
     /**
      * Defintion of the different command opcodes.
      * See section 3.3 Command Opcodes
+     *
+     * CMD_GET:  body is (uint32_t count, key), the reply body is a result
+     *           block: uint32_t n, then n times (uint32_t length, name).
+     * CMD_MGET: body is any number of (uint32_t count, uint32_t keylen, key)
+     *           tuples, the reply body is one result block per tuple, in
+     *           the order of the request.
+     *
+     * When the deadline of the request runs out, the queries stop and the
+     * reply is sent with RESPONSE_PARTIAL and the items found until then.
      */
     typedef enum
     {
         CMD_GET = 0x00,
+        CMD_MGET = 0x01,
     } binary_command;
 
     /**
@@ -138,6 +155,7 @@ extern "C"
         {
             uint8_t magic;
             uint8_t opcode;
+            uint16_t timeout;   /* ms the client waits for the reply, 0 for the server default */
             uint32_t bodylen;
             uint8_t opaque[0];
         } request;
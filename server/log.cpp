@@ -1,3 +1,5 @@
+#include <sys/uio.h>
+
 #include "log.h"
 #include "util.h"
 
@@ -5,6 +7,407 @@
 
 struct logger logger;
 
+/*
+ * Every thread that logs has a ring of its own, with the thread as the
+ * only producer and async_write as the only consumer, so logging takes
+ * no lock and makes no syscall. head and tail only grow, the byte of a
+ * position is at position % size. A message that does not fit in the
+ * ring is dropped and counted.
+ * The size is a power of two, so that the positions may wrap around.
+ */
+#define LOG_RING_SIZE (1024 * 1024)
+
+typedef struct log_ring
+{
+    char *buf;
+    uint32_t size;
+    uint64_t dropped;           /* written by the producer only */
+    uint64_t dropped_reported;  /* written by async_write only */
+    uint32_t head __attribute__((aligned(64)));  /* end of the messages, written by the producer */
+    uint32_t tail __attribute__((aligned(64)));  /* start of the messages, written by async_write */
+} log_ring;
+
+static log_ring *log_rings[MAX_THREAD_SLOTS];
+/* messages of threads that could not get a ring */
+static uint64_t log_ringless_dropped = 0;
+
+static log_ring *log_ring_of_thread()
+{
+    static __thread log_ring *t_ring = NULL;
+    if (t_ring != NULL)
+    {
+        return t_ring;
+    }
+
+    int slot = get_thread_slot();
+    if (slot < 0)
+    {
+        return NULL;
+    }
+    log_ring *ring = (log_ring *)calloc(1, sizeof(log_ring));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+    ring->size = logger.ring_size;
+    ring->buf = (char *)malloc(ring->size);
+    if (ring->buf == NULL)
+    {
+        free(ring);
+        return NULL;
+    }
+    __atomic_store_n(&log_rings[slot], ring, __ATOMIC_RELEASE);
+    t_ring = ring;
+    return ring;
+}
+
+/*
+ * In deferred mode every message in a ring is a log_record followed by
+ * the arguments of its conversions in the order of fmt: an integer or a
+ * pointer as an int64_t, a floating point as a double, a string as its
+ * bytes and a '\0'. A record without fmt carries text formatted by its
+ * producer, such as a hexdump.
+ */
+typedef struct log_record
+{
+    uint32_t len;       /* bytes of the record and its arguments */
+    uint32_t nspecs;    /* conversions of fmt whose arguments made it into the record */
+    time_t when;
+    const char *file;
+    const char *func;
+    const char *fmt;
+    int line;
+} log_record;
+
+enum
+{
+    LOG_ARG_UNKNOWN,
+    LOG_ARG_NONE,       /* %% and %n */
+    LOG_ARG_INT,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STRING,
+    LOG_ARG_POINTER,
+};
+
+typedef struct log_spec
+{
+    const char *start;  /* the '%' */
+    const char *end;    /* past the conversion */
+    int type;
+    bool is_signed;
+    char mod;           /* length modifier, 'H' for hh and 'q' for ll */
+    char conv;
+    int stars;          /* widths and precisions taken from the arguments */
+    bool star_prec;
+    int prec;           /* -1 if not given in fmt */
+} log_spec;
+
+/* parses the conversion starting at the '%' p */
+static const char *log_parse_spec(const char *p, log_spec *spec)
+{
+    spec->start = p++;
+    spec->stars = 0;
+    spec->star_prec = false;
+    spec->prec = -1;
+
+    p += strspn(p, "-+ #0'");
+    if (*p == '*')
+    {
+        spec->stars++;
+        p++;
+    }
+    p += strspn(p, "0123456789");
+    if (*p == '.')
+    {
+        p++;
+        if (*p == '*')
+        {
+            spec->stars++;
+            spec->star_prec = true;
+            p++;
+        }
+        else
+        {
+            spec->prec = atoi(p);
+            p += strspn(p, "0123456789");
+        }
+    }
+
+    spec->mod = 0;
+    if ((p[0] == 'h' || p[0] == 'l') && p[1] == p[0])
+    {
+        spec->mod = p[0] == 'h' ? 'H' : 'q';
+        p += 2;
+    }
+    else if (*p != '\0' && strchr("hlqzjtL", *p) != NULL)
+    {
+        spec->mod = *p++;
+    }
+
+    spec->conv = *p;
+    spec->end = *p != '\0' ? p + 1 : p;
+    spec->is_signed = spec->conv == 'd' || spec->conv == 'i' || spec->conv == 'c';
+    switch (spec->conv)
+    {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+        spec->type = LOG_ARG_INT;
+        break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        spec->type = LOG_ARG_DOUBLE;
+        break;
+    case 's':
+        spec->type = LOG_ARG_STRING;
+        break;
+    case 'p':
+        spec->type = LOG_ARG_POINTER;
+        break;
+    case '%': case 'n':
+        spec->type = LOG_ARG_NONE;
+        break;
+    default:
+        spec->type = LOG_ARG_UNKNOWN;
+        break;
+    }
+    return spec->end;
+}
+
+/*
+ * Copies the arguments of fmt after the record in buf. What does not fit
+ * is left out, a string is cut short first.
+ */
+static int log_pack_record(char *buf, int size, const char *fmt, va_list args)
+{
+    log_record *rec = (log_record *)buf;
+    char *arg = buf + sizeof(log_record);
+    char *end = buf + size;
+
+    rec->nspecs = 0;
+    for (const char *p = strchr(fmt, '%'); p != NULL; p = strchr(p, '%'))
+    {
+        log_spec spec;
+        p = log_parse_spec(p, &spec);
+        if (spec.type == LOG_ARG_UNKNOWN
+            || end - arg < (int)sizeof(int64_t) * (spec.stars + 1))
+        {
+            break;
+        }
+
+        for (int i = 0; i < spec.stars; i++)
+        {
+            int64_t star = va_arg(args, int);
+            if (spec.star_prec && i == spec.stars - 1)
+            {
+                spec.prec = star;
+            }
+            memcpy(arg, &star, sizeof(star));
+            arg += sizeof(star);
+        }
+
+        int64_t value = 0;
+        switch (spec.type)
+        {
+        case LOG_ARG_NONE:
+            if (spec.conv == 'n')
+            {
+                va_arg(args, void *);
+            }
+            break;
+        case LOG_ARG_INT:
+            switch (spec.mod)
+            {
+            case 'l':
+                value = spec.is_signed ? va_arg(args, long) : (int64_t)va_arg(args, unsigned long);
+                break;
+            case 'q':
+                value = spec.is_signed ? va_arg(args, long long) : (int64_t)va_arg(args, unsigned long long);
+                break;
+            case 'z':
+                value = va_arg(args, size_t);
+                break;
+            case 'j':
+                value = va_arg(args, intmax_t);
+                break;
+            case 't':
+                value = va_arg(args, ptrdiff_t);
+                break;
+            default:
+                value = spec.is_signed ? va_arg(args, int) : (int64_t)va_arg(args, unsigned int);
+                break;
+            }
+            memcpy(arg, &value, sizeof(value));
+            arg += sizeof(value);
+            break;
+        case LOG_ARG_DOUBLE:
+        {
+            double d = spec.mod == 'L' ? (double)va_arg(args, long double) : va_arg(args, double);
+            memcpy(arg, &d, sizeof(d));
+            arg += sizeof(d);
+            break;
+        }
+        case LOG_ARG_POINTER:
+            value = (intptr_t)va_arg(args, void *);
+            memcpy(arg, &value, sizeof(value));
+            arg += sizeof(value);
+            break;
+        case LOG_ARG_STRING:
+        {
+            const char *str = va_arg(args, const char *);
+            if (str == NULL)
+            {
+                str = "(null)";
+            }
+            size_t n = spec.prec >= 0 ? strnlen(str, spec.prec) : strlen(str);
+            n = MIN(n, (size_t)(end - arg - 1));
+            memcpy(arg, str, n);
+            arg[n] = '\0';
+            arg += n + 1;
+            break;
+        }
+        }
+        rec->nspecs++;
+    }
+    return arg - buf;
+}
+
+template <typename T>
+static int log_render_arg(char *out, int size, const char *spec, int stars, const int64_t *star, T value)
+{
+    switch (stars)
+    {
+    case 0:
+        return snprintf(out, size, spec, value);
+    case 1:
+        return snprintf(out, size, spec, (int)star[0], value);
+    default:
+        return snprintf(out, size, spec, (int)star[0], (int)star[1], value);
+    }
+}
+
+static void format_timestamp(time_t when, char *txt, int len);
+
+/* formats a record as _log would have, into out of size bytes */
+static int log_render_record(const char *buf, char *out, int size)
+{
+    static time_t stamp_when = 0;
+    static char stamp[64];
+
+    const log_record *rec = (const log_record *)buf;
+    const char *arg = buf + sizeof(log_record);
+    if (rec->fmt == NULL)
+    {
+        int len = MIN(rec->len - sizeof(log_record), (size_t)size);
+        memcpy(out, arg, len);
+        return len;
+    }
+
+    //only async_write renders, and its records are mostly of the same second
+    if (rec->when != stamp_when)
+    {
+        format_timestamp(rec->when, stamp, sizeof(stamp));
+        stamp_when = rec->when;
+    }
+    int len = snprintf(out, size, "[%s] %s:%s:%d ", stamp, rec->file, rec->func, rec->line);
+
+    const char *p = rec->fmt;
+    for (uint32_t i = 0; *p != '\0' && len < size - 1; i++)
+    {
+        const char *next = strchr(p, '%');
+        if (next == NULL)
+        {
+            next = p + strlen(p);
+        }
+        int n = MIN(next - p, size - 1 - len);
+        memcpy(out + len, p, n);
+        len += n;
+        if (*next == '\0' || i == rec->nspecs)
+        {
+            break;
+        }
+
+        log_spec spec;
+        p = log_parse_spec(next, &spec);
+        char fmt[32];
+        if (spec.end - spec.start >= (int)sizeof(fmt))
+        {
+            break;
+        }
+        memcpy(fmt, spec.start, spec.end - spec.start);
+        fmt[spec.end - spec.start] = '\0';
+
+        int64_t star[2];
+        memcpy(star, arg, sizeof(int64_t) * spec.stars);
+        arg += sizeof(int64_t) * spec.stars;
+
+        char *dst = out + len;
+        int room = size - len;
+        int64_t value;
+        double d;
+        n = 0;
+        switch (spec.type)
+        {
+        case LOG_ARG_NONE:
+            if (spec.conv == '%')
+            {
+                n = snprintf(dst, room, "%%");
+            }
+            break;
+        case LOG_ARG_INT:
+            memcpy(&value, arg, sizeof(value));
+            arg += sizeof(value);
+            switch (spec.mod)
+            {
+            case 'l':
+                n = log_render_arg(dst, room, fmt, spec.stars, star, (long)value);
+                break;
+            case 'q':
+                n = log_render_arg(dst, room, fmt, spec.stars, star, (long long)value);
+                break;
+            case 'z':
+                n = log_render_arg(dst, room, fmt, spec.stars, star, (size_t)value);
+                break;
+            case 'j':
+                n = log_render_arg(dst, room, fmt, spec.stars, star, (intmax_t)value);
+                break;
+            case 't':
+                n = log_render_arg(dst, room, fmt, spec.stars, star, (ptrdiff_t)value);
+                break;
+            default:
+                n = log_render_arg(dst, room, fmt, spec.stars, star, (int)value);
+                break;
+            }
+            break;
+        case LOG_ARG_DOUBLE:
+            memcpy(&d, arg, sizeof(d));
+            arg += sizeof(d);
+            if (spec.mod == 'L')
+            {
+                n = log_render_arg(dst, room, fmt, spec.stars, star, (long double)d);
+            }
+            else
+            {
+                n = log_render_arg(dst, room, fmt, spec.stars, star, d);
+            }
+            break;
+        case LOG_ARG_POINTER:
+            memcpy(&value, arg, sizeof(value));
+            arg += sizeof(value);
+            n = log_render_arg(dst, room, fmt, spec.stars, star, (void *)(intptr_t)value);
+            break;
+        case LOG_ARG_STRING:
+            n = log_render_arg(dst, room, fmt, spec.stars, star, arg);
+            arg += strlen(arg) + 1;
+            break;
+        }
+        len = MIN(len + n, size - 1);
+    }
+
+    if (len < size && (len == 0 || out[len - 1] != '\n'))
+    {
+        out[len++] = '\n';
+    }
+    return len;
+}
+
 const int log_cfg_num = 8;
 log_conf log_cfg[MAX_LOG_LEVEL] =
 {
@@ -59,29 +462,181 @@ static int log_open_file(char *name)
     return fd;
 }
 
-static int my_write(int fd, char *buffer, int size)
+/* writes all of iov, which is changed on the way */
+static int my_writev(int fd, struct iovec *iov, int iovcnt)
 {
-    while (1)
+    while (iovcnt > 0)
     {
-        if (write(fd, buffer, size) < 0)
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0)
         {
             if (EINTR == errno)
             {
                 continue;
             }
-            else
-            {
-                return -1;
-            }
+            return -1;
         }
-        else
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
         {
-            return 0;
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
         }
     }
     return 0;
 }
 
+static void get_timestamp(char *txt, int len);
+
+/* notes the messages a ring dropped since the last time */
+static int log_report_dropped(log_ring *ring, int slot, char *buf, int size)
+{
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped == ring->dropped_reported)
+    {
+        return 0;
+    }
+    char stamp[64];
+    get_timestamp(stamp, sizeof(stamp));
+    int len = snprintf(buf, size, "[%s] log: %" PRIu64 " messages of thread %d dropped, its ring is full\n",
+                       stamp, dropped - ring->dropped_reported, slot);
+    ring->dropped_reported = dropped;
+    return MIN(len, size - 1);
+}
+
+/*
+ * Writes what every ring holds with one writev, the messages of a ring
+ * are at most two pieces of it.
+ */
+static void log_drain_rings(struct logger *l)
+{
+    struct iovec iov[3 * MAX_THREAD_SLOTS];
+    log_ring *rings[MAX_THREAD_SLOTS];
+    uint32_t heads[MAX_THREAD_SLOTS];
+    char notes[MAX_THREAD_SLOTS][128];
+    int iovcnt = 0;
+
+    for (int i = 0; i < MAX_THREAD_SLOTS; i++)
+    {
+        log_ring *ring = rings[i] = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+        if (ring == NULL)
+        {
+            continue;
+        }
+        int len = log_report_dropped(ring, i, notes[i], sizeof(notes[i]));
+        if (len > 0)
+        {
+            iov[iovcnt].iov_base = notes[i];
+            iov[iovcnt++].iov_len = len;
+        }
+
+        uint32_t tail = ring->tail;
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        heads[i] = head;
+        if (head == tail)
+        {
+            continue;
+        }
+        uint32_t start = tail % ring->size;
+        uint32_t count = head - tail;
+        uint32_t first = MIN(count, ring->size - start);
+        iov[iovcnt].iov_base = ring->buf + start;
+        iov[iovcnt++].iov_len = first;
+        if (count > first)
+        {
+            iov[iovcnt].iov_base = ring->buf;
+            iov[iovcnt++].iov_len = count - first;
+        }
+    }
+
+    if (iovcnt > 0 && my_writev(l->fd, iov, iovcnt) < 0)
+    {
+        l->nerror = 1;
+    }
+
+    //the messages are gone even if the write failed, the rings must not fill up
+    for (int i = 0; i < MAX_THREAD_SLOTS; i++)
+    {
+        if (rings[i] != NULL)
+        {
+            __atomic_store_n(&rings[i]->tail, heads[i], __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/* copies n bytes of a ring from the position pos */
+static void log_ring_copy(log_ring *ring, uint32_t pos, char *dst, uint32_t n)
+{
+    uint32_t start = pos % ring->size;
+    uint32_t first = MIN(n, ring->size - start);
+    memcpy(dst, ring->buf + start, first);
+    memcpy(dst + first, ring->buf, n - first);
+}
+
+#define LOG_RENDER_SIZE (256 * 1024)
+
+static void log_flush(struct logger *l, char *buf, int *len)
+{
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = *len;
+    if (*len > 0 && my_writev(l->fd, &iov, 1) < 0)
+    {
+        l->nerror = 1;
+    }
+    *len = 0;
+}
+
+/*
+ * Deferred mode: formats the records of every ring into a buffer written
+ * whenever it may not hold the next record. A record is released as
+ * soon as it is formatted.
+ */
+static void log_render_rings(struct logger *l)
+{
+    static char out[LOG_RENDER_SIZE];
+    static char rec[sizeof(log_record) + 8 * LOG_MAX_LEN] __attribute__((aligned(8)));
+    const int reserve = sizeof(rec) + 128;
+    int len = 0;
+
+    for (int i = 0; i < MAX_THREAD_SLOTS; i++)
+    {
+        log_ring *ring = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+        if (ring == NULL)
+        {
+            continue;
+        }
+        if (LOG_RENDER_SIZE - len < reserve)
+        {
+            log_flush(l, out, &len);
+        }
+        len += log_report_dropped(ring, i, out + len, 128);
+
+        uint32_t tail = ring->tail;
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head)
+        {
+            log_record hdr;
+            log_ring_copy(ring, tail, (char *)&hdr, sizeof(hdr));
+            log_ring_copy(ring, tail, rec, MIN(hdr.len, sizeof(rec)));
+            tail += hdr.len;
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+            if (LOG_RENDER_SIZE - len < reserve)
+            {
+                log_flush(l, out, &len);
+            }
+            len += log_render_record(rec, out + len, reserve);
+        }
+    }
+    log_flush(l, out, &len);
+}
+
 static void *async_write(void *argv)
 {
     struct logger *l = &logger;
@@ -94,26 +649,22 @@ static void *async_write(void *argv)
         {
             close(l->fd);
             l->fd = -1;
-            if (log_open_file(l->name) < 0)
+            if ((l->fd = log_open_file(l->name)) < 0)
             {
                 printf("open log file failed\n");
                 continue;
             }
+            l->nerror = 0;
         }
 
-        int wpos = 0;
-        int index = l->buffer_index;
-        l->buffer_index = (l->buffer_index + 1) % 2;
-
-        pthread_mutex_lock(&l->buffer_locks[index]);
-        wpos = l->buffer_wpos[index];
-
-        if (wpos > 0 && my_write(l->fd, l->buffer[index], wpos) < 0)
+        if (l->deferred)
+        {
+            log_render_rings(l);
+        }
+        else
         {
-            l->nerror = 1;
+            log_drain_rings(l);
         }
-        l->buffer_wpos[index] = 0;
-        pthread_mutex_unlock(&l->buffer_locks[index]);
     }
 }
 
@@ -122,9 +673,8 @@ int log_init_file(char *name)
 {
     struct logger *l = &logger;
 
-    l->max_buffer_size = 1024 * 1024 * 10;
+    l->ring_size = LOG_RING_SIZE;
     l->write_interval = 100;
-    l->buffer_index = 0;
     l->name = strdup(name);
     if (name == NULL || !strlen(name))
     {
@@ -141,57 +691,20 @@ int log_init_file(char *name)
         }
     }
 
-    //init buffer
-    int i = 0;
-    while (i < 2)
+    //init the thread writing the rings
+    if (pthread_create(&l->file_async_writer, NULL, async_write, NULL) != 0)
     {
-        pthread_mutex_init(&l->buffer_locks[i], NULL);
-        char *buffer = (char *)calloc(1, l->max_buffer_size);
-        if (NULL == buffer)
-        {
-            goto failed;
-        }
-        l->buffer[i] = buffer;
-        l->buffer_wpos[i] = 0;
-        i++;
-    }
-
-    //init buffer write thread
-    if (pthread_create(&l->file_async_writer, NULL, async_write, NULL) < 0)
-    {
-        goto failed;
+        return -1;
     }
 
     l->inited = 1;
     return 0;
-
-failed:
-    i = 0;
-    while (i < 2)
-    {
-        if (l->buffer[i] != NULL)
-        {
-            free(l->buffer[i]);
-        }
-        i++;
-    }
-    return -1;
 }
 
 int log_deinit_file()
 {
     struct logger *l = &logger;
 
-    int i = 0;
-    while (i < 2)
-    {
-        if (l->buffer[i] != NULL)
-        {
-            free(l->buffer[i]);
-        }
-        i++;
-    }
-
     free(l->name);
     l->name = NULL;
 
@@ -254,6 +767,7 @@ int log_init(int type, char *level, char *name, char *server, short port)
     int levellog = parse_loglevel(level);
     l->level = MAX(LOG_EMERG, MIN(levellog, LOG_DEBUG));
     l->type = type;
+    l->deferred = (type & LOG_DEFERRED) != 0;
     l->nerror = 0;
 
     if (type & GENERIC_FILE)
@@ -367,55 +881,93 @@ int log_loggable(int level)
     return 1;
 }
 
-static int _log_internal(char *str_buf, int len)
+uint64_t log_dropped(void)
 {
-    struct logger *l = &logger;
-    int index = 0;
-    int wpos = 0;
+    uint64_t dropped = __atomic_load_n(&log_ringless_dropped, __ATOMIC_RELAXED);
+    for (int i = 0; i < MAX_THREAD_SLOTS; i++)
+    {
+        log_ring *ring = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+        if (ring != NULL)
+        {
+            dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        }
+    }
+    return dropped;
+}
 
+/* puts prefix and str_buf in the ring of the thread as one message */
+static int _log_internal(const char *prefix, int prefix_len, const char *str_buf, int len)
+{
     if (NULL == str_buf || len == 0)
     {
         return 0;
     }
 
-    index = l->buffer_index;
-    pthread_mutex_lock(&l->buffer_locks[index]);
+    log_ring *ring = log_ring_of_thread();
+    if (ring == NULL)
+    {
+        __sync_add_and_fetch(&log_ringless_dropped, 1);
+        return -1;
+    }
 
-    wpos = l->buffer_wpos[index];
-    if (wpos + len < l->max_buffer_size)
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if ((uint32_t)(prefix_len + len) > ring->size - (head - tail))
     {
-        strncpy(l->buffer[index] + wpos, str_buf, len);
-        l->buffer_wpos[index] += len;
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return 0;
     }
-    else
+
+    const char *pieces[2] = {prefix, str_buf};
+    int lens[2] = {prefix_len, len};
+    uint32_t pos = head;
+    for (int i = 0; i < 2; i++)
     {
-        if (wpos > 0 && my_write(l->fd, l->buffer[index], wpos) < 0)
+        if (lens[i] == 0)
         {
-            l->nerror = 1;
+            continue;
         }
-        l->buffer_wpos[index] = 0;
-        strncpy(l->buffer[index], str_buf, len);
-        l->buffer_wpos[index] += len;
+        uint32_t start = pos % ring->size;
+        uint32_t first = MIN((uint32_t)lens[i], ring->size - start);
+        memcpy(ring->buf + start, pieces[i], first);
+        memcpy(ring->buf, pieces[i] + first, lens[i] - first);
+        pos += lens[i];
     }
-
-    pthread_mutex_unlock(&l->buffer_locks[index]);
+    __atomic_store_n(&ring->head, pos, __ATOMIC_RELEASE);
     return 0;
 }
 
-static void get_timestamp(char *txt, int len)
+/* formatted text, in deferred mode behind a record without fmt */
+static int _log_text(char *str_buf, int len)
+{
+    if (!logger.deferred)
+    {
+        return _log_internal(NULL, 0, str_buf, len);
+    }
+
+    log_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.len = sizeof(rec) + len;
+    return _log_internal((char *)&rec, sizeof(rec), str_buf, len);
+}
+
+static void format_timestamp(time_t when, char *txt, int len)
 {
-    time_t gmt;
     struct tm *timeptr;
     struct tm timestruct;
 
-    time(&gmt);
-    timeptr = localtime_r(&gmt, &timestruct);
+    timeptr = localtime_r(&when, &timestruct);
     snprintf(txt, len,
              "%04d.%02d.%02d %02d:%02d:%02d",
              timeptr->tm_year + 1900, timeptr->tm_mon + 1, timeptr->tm_mday,
              timeptr->tm_hour, timeptr->tm_min, timeptr->tm_sec);
 }
 
+static void get_timestamp(char *txt, int len)
+{
+    format_timestamp(time(NULL), txt, len);
+}
+
 void _log(const char *file, const char *func, int line, const char *fmt, ...)
 {
 #define STRLEN 256
@@ -438,6 +990,27 @@ void _log(const char *file, const char *func, int line, const char *fmt, ...)
     }
 
     errno_save = errno;
+    if (l->deferred)
+    {
+        char record[sizeof(log_record) + LOG_MAX_LEN] __attribute__((aligned(8)));
+        log_record *rec = (log_record *)record;
+        struct timespec now;
+
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
+        rec->when = now.tv_sec;
+        rec->file = file;
+        rec->func = func;
+        rec->fmt = fmt;
+        rec->line = line;
+        va_start(args, fmt);
+        rec->len = log_pack_record(record, sizeof(record), fmt, args);
+        va_end(args);
+
+        _log_internal(NULL, 0, record, rec->len);
+        errno = errno_save;
+        return;
+    }
+
     len = 0;            /* length of output buffer */
     size = LOG_MAX_LEN; /* size of output buffer */
 
@@ -455,7 +1028,7 @@ void _log(const char *file, const char *func, int line, const char *fmt, ...)
         buf[len] = '\0';
     }
 
-    _log_internal(buf, len);
+    _log_internal(NULL, 0, buf, len);
 
     errno = errno_save;
 }
@@ -548,7 +1121,7 @@ void _log_hexdump(const char *file, const char *func, int line, char *data, int
         off += 16;
     }
 
-    n = _log_internal(buf, len);
+    n = _log_text(buf, len);
     if (n < 0)
     {
         l->nerror++;
@@ -11,17 +11,14 @@ struct logger
     int  nerror;    /* # log error */
     int  type;      /*log type*/
     int  inited;    /*log is inited*/
+    int  deferred;  /*the rings hold records formatted by async_write*/
 
     //file
     char *name;  /* log file name */
     int  fd;     /* log file descriptor */
-    int max_buffer_size; /*max buffer size*/
+    int ring_size;      /*bytes of the ring of each thread*/
     int write_interval; /*write file interval*/
-    pthread_mutex_t buffer_locks[2]; /*buffer locks*/
-    volatile int buffer_index;   /*buffer index*/
-    char *buffer[2];    /*buffers*/
-    unsigned int buffer_wpos[2];    /*buffer write pos*/
-    pthread_t file_async_writer; /*write buffer to file thread*/
+    pthread_t file_async_writer; /*write the rings to file thread*/
 
     //database
     char *ip;   /*database server ip*/
@@ -33,6 +30,12 @@ struct logger
 #define GENERIC_FILE    0x01
 #define DATABASE        0x02
 #define LEVELDB         0x04
+/*
+ * The workers put the format, the time and the arguments of a message in
+ * their ring, and async_write does the formatting. The format, __FILE__
+ * and __FUNCTION__ are kept as pointers, so formats must be literals.
+ */
+#define LOG_DEFERRED    0x08
 
 #define MAX(a, b) ((a)>(b)?(a):(b))
 #define MIN(a, b) ((a)<(b)?(a):(b))
@@ -87,6 +90,8 @@ void log_level_down(void);
 void log_level_set(int level);
 void log_reopen(void);
 int log_loggable(int level);
+/* messages dropped because the ring of their thread was full */
+uint64_t log_dropped(void);
 void _log(const char *file, const char *func, int line, const char *fmt, ...);
 void _log_stderr(const char *fmt, ...);
 void _log_hexdump(const char *file, char *func, int line, char *data, int datalen, const char *fmt, ...);
@@ -11,6 +11,8 @@ extern void out_string(conn *c, const char *str);
 
 static conn *listen_conn = NULL;
 
+volatile bool allow_new_conns = true;
+
 /*
  * read from network as much as we can, handle buffer overflow and connection
  * close.
@@ -68,6 +70,7 @@ enum try_read_result try_read_network(conn *c)
         res = read(c->sfd, c->rbuf + c->rbytes, avail);
         if (res > 0)
         {
+            thread_count(&c->thread->bytes_read, res);
             gotdata = READ_DATA_RECEIVED;
             c->rbytes += res;
             if (res == avail)
@@ -106,10 +109,11 @@ enum try_read_result try_read_udp(conn *c)
 
     c->request_addr_size = sizeof(c->request_addr);
     res = recvfrom(c->sfd, c->rbuf, c->rsize,
-                   0, &c->request_addr, &c->request_addr_size);
+                   0, (struct sockaddr *)&c->request_addr, &c->request_addr_size);
     if (res > 8)
     {
         unsigned char *buf = (unsigned char *)c->rbuf;
+        thread_count(&c->thread->bytes_read, res);
 
         /* Beginning of UDP packet is the request ID; save it. */
         c->request_id = buf[0] * 256 + buf[1];
@@ -162,6 +166,7 @@ void do_accept_new_conns(const bool do_accept)
 {
     conn *next;
 
+    allow_new_conns = do_accept;
     for (next = listen_conn; next; next = next->next)
     {
         if (do_accept)
@@ -283,10 +288,11 @@ void maximize_sndbuf(const int sfd)
  *        when they are successfully added to the list of ports we
  *        listen on.
  */
-int server_socket(const char *interface,
-                  int port,
-                  enum network_transport transport,
-                  FILE *portnumber_file)
+static int server_socket_on(const char *interface,
+                            int port,
+                            enum network_transport transport,
+                            FILE *portnumber_file,
+                            LIBEVENT_THREAD *thread)
 {
     int sfd;
     struct linger ling = {0, 0};
@@ -304,7 +310,7 @@ ai_family :
     int success = 0;
     int flags = 1;
 
-    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_socktype = IS_UDP(transport) ? SOCK_DGRAM : SOCK_STREAM;
 
     if (port == -1)
     {
@@ -357,22 +363,41 @@ ai_family :
 
         setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
 
-        error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
-        if (error != 0)
+        if (thread != NULL)
         {
-            log_debug(LOG_ERR, "setsockopt, error:%s\n", strerror(errno));
+            error = setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+            if (error != 0)
+            {
+                log_debug(LOG_ERR, "setsockopt(SO_REUSEPORT), error:%s\n", strerror(errno));
+                close(sfd);
+                freeaddrinfo(ai);
+                return 1;
+            }
         }
 
-        error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
-        if (error != 0)
+        if (IS_UDP(transport))
         {
-            log_debug(LOG_ERR, "setsockopt, error:%s\n", strerror(errno));
+            maximize_sndbuf(sfd);
         }
-
-        error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
-        if (error != 0)
+        else
         {
-            log_debug(LOG_ERR, "setsockopt, error:%s\n", strerror(errno));
+            error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+            if (error != 0)
+            {
+                log_debug(LOG_ERR, "setsockopt, error:%s\n", strerror(errno));
+            }
+
+            error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+            if (error != 0)
+            {
+                log_debug(LOG_ERR, "setsockopt, error:%s\n", strerror(errno));
+            }
+
+            error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+            if (error != 0)
+            {
+                log_debug(LOG_ERR, "setsockopt, error:%s\n", strerror(errno));
+            }
         }
 
         if (bind(sfd, next->ai_addr, next->ai_addrlen) == -1)
@@ -390,7 +415,7 @@ ai_family :
         else
         {
             success++;
-            if (listen(sfd, g_settings.backlog) == -1)
+            if (!IS_UDP(transport) && listen(sfd, g_settings.backlog) == -1)
             {
                 log_debug(LOG_ERR, "listen(), error:%s\n", strerror(errno));
                 close(sfd);
@@ -412,13 +437,13 @@ ai_family :
                     if (next->ai_addr->sa_family == AF_INET)
                     {
                         fprintf(portnumber_file, "%s INET: %u\n",
-                                "TCP",
+                                IS_UDP(transport) ? "UDP" : "TCP",
                                 ntohs(my_sockaddr.in.sin_port));
                     }
                     else
                     {
                         fprintf(portnumber_file, "%s INET6: %u\n",
-                                "TCP",
+                                IS_UDP(transport) ? "UDP" : "TCP",
                                 ntohs(my_sockaddr.in6.sin6_port));
                     }
                 }
@@ -426,13 +451,35 @@ ai_family :
         }
 
 
+        if (IS_UDP(transport))
+        {
+            /*
+             * No listening conn, every worker serving the port reads the
+             * datagrams on a dup of the socket of its own.
+             */
+            int nthreads = g_settings.num_threads_per_udp;
+            for (int i = 0; i < nthreads; i++)
+            {
+                int per_thread_fd = i ? dup(sfd) : sfd;
+                if (per_thread_fd < 0)
+                {
+                    log_debug(LOG_ERR, "dup(), error:%s\n", strerror(errno));
+                    break;
+                }
+                dispatch_conn_to(i, per_thread_fd, conn_read, EV_READ | EV_PERSIST,
+                                 UDP_READ_BUFFER_SIZE, transport);
+            }
+            continue;
+        }
+
         if (!(listen_conn_add = conn_new(sfd, conn_listening,
                                          EV_READ | EV_PERSIST, 1,
-                                         transport, main_base)))
+                                         transport, thread ? thread->base : main_base)))
         {
             log_debug(LOG_ERR, "failed to create listening connection\n");
             exit(EXIT_FAILURE);
         }
+        listen_conn_add->thread = thread;
         listen_conn_add->next = listen_conn;
         listen_conn = listen_conn_add;
     }
@@ -443,12 +490,25 @@ ai_family :
     return success == 0;
 }
 
+int server_socket(const char *interface,
+                  int port,
+                  enum network_transport transport,
+                  FILE *portnumber_file)
+{
+    return server_socket_on(interface, port, transport, portnumber_file, NULL);
+}
+
 int server_sockets(int port, enum network_transport transport,
                    FILE *portnumber_file)
 {
     return server_socket(NULL, port, transport, portnumber_file);
 }
 
+int server_sockets_reuseport(int port, LIBEVENT_THREAD *thread)
+{
+    return server_socket_on(NULL, port, tcp_transport, NULL, thread);
+}
+
 int new_socket_unix(void)
 {
     int sfd;
@@ -535,6 +595,7 @@ int server_socket_unix(const char *path, int access_mask)
         log_debug(LOG_ERR, "failed to create listening connection\n");
         exit(EXIT_FAILURE);
     }
+    listen_conn->thread = NULL;
 
     return 0;
 }
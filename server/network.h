@@ -12,8 +12,12 @@ enum try_read_result
 };
 
 enum try_read_result try_read_network(conn *c);
+enum try_read_result try_read_udp(conn *c);
 bool update_event(conn *c, const int new_flags);
 
+/* false while accepting is paused, e.g. because we ran out of fds */
+extern volatile bool allow_new_conns;
+
 void do_accept_new_conns(const bool do_accept);
 void event_handler(const int fd, const short which, void *arg);
 
@@ -27,6 +31,9 @@ int server_socket(const char *interface,
 int server_sockets(int port, enum network_transport transport,
                    FILE *portnumber_file);
 
+/* a SO_REUSEPORT listening socket accepting on the event base of thread */
+int server_sockets_reuseport(int port, LIBEVENT_THREAD *thread);
+
 int new_socket_unix(void);
 
 int server_socket_unix(const char *path, int access_mask);
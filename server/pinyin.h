@@ -0,0 +1,65 @@
+#ifndef __PINYIN_H__
+#define __PINYIN_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+ * The pinyin readings of characters, as a flat table indexed by unicode
+ * codepoint. Each distinct syllable is stored once and referred to by id.
+ *
+ * The table is built from the text file ("<char> <reading> [<reading>...]"
+ * per line) or read from the binary image written by pinyin_map_save(),
+ * which is what it looks like in memory:
+ *
+ *  "PYMP" version first count nrefs nsyllables textsize
+ *  slots[count + 1]            readings of first + i are refs[slots[i]..slots[i + 1])
+ *  refs[nrefs]                 syllable ids (uint16_t)
+ *  syllables[nsyllables + 1]   syllable i is text[syllables[i]..syllables[i + 1])
+ *  text[textsize]
+ */
+typedef struct pinyin_map
+{
+    vector<char> blob;
+    uint32_t first;             /* the first codepoint of the table */
+    uint32_t count;             /* the number of codepoints */
+    uint32_t nsyllables;
+    const uint32_t *slots;
+    const uint16_t *refs;
+    const uint32_t *syllables;
+    const char *text;
+} pinyin_map;
+
+/* load the text file or the binary image, detected by its magic */
+int pinyin_map_load(const char *file, pinyin_map &map);
+int pinyin_map_save(const char *file, const pinyin_map &map);
+
+/*
+    decode the utf8 character at p, at most end - p bytes long.
+    advance p past it, by one byte if it is not valid utf8.
+    return the codepoint, or 0 if it is not valid.
+*/
+uint32_t decode_utf8(const char *&p, const char *end);
+
+/* the number of readings of a codepoint, their syllable ids go to ids */
+static inline uint32_t pinyin_readings(const pinyin_map &map, uint32_t cp, const uint16_t *&ids)
+{
+    uint32_t i = cp - map.first;
+    if (i >= map.count)
+    {
+        return 0;
+    }
+    ids = map.refs + map.slots[i];
+    return map.slots[i + 1] - map.slots[i];
+}
+
+static inline const char *pinyin_syllable(const pinyin_map &map, uint16_t id, uint32_t &length)
+{
+    length = map.syllables[id + 1] - map.syllables[id];
+    return map.text + map.syllables[id];
+}
+
+#endif
@@ -1,75 +1,69 @@
 #include "prefixmatch.h"
+#include "pinyin.h"
+#include "cache.h"
+#include "stats.h"
 #include "config.h"
 #include "log.h"
 
-static int g_reloading = 0;
-static int g_exiting = 0;
-static pthread_rwlock_t  rwlock = PTHREAD_RWLOCK_INITIALIZER;
+/* index states, changed with atomic operations only */
+enum index_state
+{
+    INDEX_IDLE = 0,
+    INDEX_LOADING,      /* a new index is being read */
+    INDEX_DRAINING,     /* the previous index waits for its last reader */
+    INDEX_EXITING
+};
+static int g_state = INDEX_IDLE;
 
 #define MAX_FILE_LEN 256
-#define INITIAL_HASH_SIZE 100000
 #define DEFAULT_CHINESE_MAP "./chinese"
 #define DEFAULT_INPUT_RANK_FILE "./input"
 #define DEFAULT_OUTPUT_INDEX "./index"
 
-class NodeItem
+bool rank_compare(const result_item &s1, const result_item &s2)
 {
-public:
-    inline bool operator<(const NodeItem &v1) const
-    {
-        if (this->strName < v1.strName)
-        {
-            return true;
-        }
-        else
-        {
-            return false;
-        }
-    }
-    friend bool rank_compare(const NodeItem &s1, const NodeItem &s2);
+    return s1.rank < s2.rank;
+}
 
-    string strName;
-    float  fRank;
-};
+static bool name_compare(const result_item &s1, const result_item &s2)
+{
+    int ret = memcmp(s1.name, s2.name, min(s1.length, s2.length));
+    return ret < 0 || (ret == 0 && s1.length < s2.length);
+}
 
-bool rank_compare(const NodeItem &s1, const NodeItem &s2)
+static inline bool name_equal(const result_item &s1, const result_item &s2)
 {
-    return s1.fRank < s2.fRank;
+    return s1.length == s2.length && memcmp(s1.name, s2.name, s1.length) == 0;
 }
 
-class string_array : public std::vector<NodeItem>
+/*
+ * The leaf value of the index: (name, rank) pairs written by the indexer.
+ * Only the read side is needed here, and it does not copy anything: every
+ * item points at its name inside the mmapped TAIL block.
+ */
+class string_array_view : public std::vector<result_item>
 {
 public:
-    friend dastrie::itail &operator>>(dastrie::itail &is, string_array &obj)
+    friend dastrie::itail &operator>>(dastrie::itail &is, string_array_view &obj)
     {
         obj.clear();
 
-        NodeItem item;
+        result_item item;
+        dastrie::itail::size_type length;
         uint32_t n;
         is >> n;
         for (uint32_t i = 0; i < n; ++i)
         {
-            is >> item.strName;
-            is >> item.fRank;
+            is.read_string(item.name, length);
+            is >> item.rank;
+            item.length = (uint32_t)length;
             obj.push_back(item);
         }
         return is;
     }
-
-    friend dastrie::otail &operator<<(dastrie::otail &os, const string_array &obj)
-    {
-        os << (uint32_t)obj.size();
-        for (size_t i = 0; i < obj.size(); ++i)
-        {
-            os << obj[i].strName;
-            os << obj[i].fRank;
-        }
-        return os;
-    }
 };
 
-typedef dastrie::trie<string_array> trie_type;
-typedef unordered_map<string, vector<string> > hashMap;
+typedef dastrie::trie<string_array_view> trie_type;
 typedef struct index
 {
     char index_file[MAX_FILE_LEN];
@@ -77,12 +71,107 @@ typedef struct index
     int  fsize;
     trie_type g_dasTrieObj;
 } indexobj;
-hashMap chinese_map(INITIAL_HASH_SIZE);
-indexobj g_index;
+pinyin_map chinese_map;
+
+/*
+ * The index is swapped RCU style. A reader publishes the index it uses in
+ * the slot of its thread, nobody else writes there, so reading needs no
+ * shared write. The index replaced by Reload_index() is kept in g_retired
+ * until no slot points at it any more.
+ */
+typedef struct reader_slot
+{
+    indexobj *index;
+    int depth;          /* nested pins of the thread */
+} __attribute__((aligned(64))) reader_slot;
+
+static indexobj *g_current = NULL;
+static uint64_t g_generation = 0;   /* bumped after each swap, tags the query cache */
+static indexobj *g_retired = NULL;
+static reader_slot g_readers[MAX_THREAD_SLOTS];
+
+/* written by Reload_index() only, which runs one at a time */
+static uint64_t g_reloads = 0;
+static uint64_t g_reload_failures = 0;
+static uint64_t g_last_reload_nsec = 0;
 
 int init_index(char *index_file, indexobj &index);
 int deinit_index(indexobj &index);
 
+static indexobj *pin_index()
+{
+    int slot = get_thread_slot();
+    if (slot < 0)
+    {
+        log_debug(LOG_ERR, "more than %d threads query the index\n", MAX_THREAD_SLOTS);
+        return NULL;
+    }
+
+    reader_slot *reader = &g_readers[slot];
+    if (reader->depth++ > 0)
+    {
+        return reader->index;
+    }
+
+    //publish, then make sure it was not replaced in between
+    indexobj *index;
+    do
+    {
+        index = __atomic_load_n(&g_current, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&reader->index, index, __ATOMIC_SEQ_CST);
+    }
+    while (index != __atomic_load_n(&g_current, __ATOMIC_SEQ_CST));
+
+    if (index == NULL)
+    {
+        log_debug(LOG_ERR, "no index is loaded\n");
+        reader->depth = 0;
+    }
+    return index;
+}
+
+static void reclaim_index();
+
+static void unpin_index()
+{
+    reader_slot *reader = &g_readers[get_thread_slot()];
+    if (--reader->depth == 0)
+    {
+        //seq_cst on both, or the load may pass the store and miss a drain
+        __atomic_store_n(&reader->index, (indexobj *)NULL, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&g_state, __ATOMIC_SEQ_CST) == INDEX_DRAINING)
+        {
+            reclaim_index();
+        }
+    }
+}
+
+//free the retired index once no reader holds it
+static void reclaim_index()
+{
+    indexobj *retired = __atomic_load_n(&g_retired, __ATOMIC_SEQ_CST);
+    if (retired == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < MAX_THREAD_SLOTS; ++i)
+    {
+        if (__atomic_load_n(&g_readers[i].index, __ATOMIC_SEQ_CST) == retired)
+        {
+            return;
+        }
+    }
+    if (!__sync_bool_compare_and_swap(&g_retired, retired, (indexobj *)NULL))
+    {
+        return;
+    }
+
+    deinit_index(*retired);
+    delete retired;
+    __sync_bool_compare_and_swap(&g_state, INDEX_DRAINING, INDEX_IDLE);
+    log_debug(LOG_NOTICE, "the previous index is released\n");
+}
+
 int mmap_file(int fd, unsigned char **mems)
 {
     struct stat st;
@@ -108,187 +197,433 @@ int mmap_file(int fd, unsigned char **mems)
     return fsize;
 }
 
-int read_chinese_map(const string &strFile, hashMap &chinese_map)
+int all_english_char(const string &strIn)
 {
-    int file_strLine = 0;
-    ifstream inf(strFile.c_str());
-    if (!inf.is_open())
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(strIn.c_str());
+    const unsigned char *pEnd = p + strIn.size();
+    while (p < pEnd)
     {
-        return -1;
+        if (*p >= 0x80)
+        {
+            return 0;
+        }
+        p++;
     }
+    return 1;
+}
+
+/* the syllable ids of the readings of one character */
+typedef struct reading
+{
+    const uint16_t *ids;
+    uint32_t count;
+} reading;
+
+/*
+ * The pinyin readings of every character of a query that has some, in
+ * order. Other characters are skipped.
+ */
+void get_readings(const string &strIn, const pinyin_map &hz2pyTable, vector<reading> &vOut)
+{
+    vOut.clear();
 
-    string strLine;
-    while (getline(inf, strLine))
+    reading r;
+    const char *p = strIn.c_str();
+    const char *pEnd = p + strIn.size();
+    while (p < pEnd)
     {
-        strLine = trim(strLine, " \t\r", 1);
-        vector<string> vResult = sepstr(strLine, " ");
-        if (vResult.size() < 2)
+        r.count = pinyin_readings(hz2pyTable, decode_utf8(p, pEnd), r.ids);
+        if (r.count > 0)
         {
-            continue;
+            vOut.push_back(r);
         }
-        chinese_map[vResult[0]] = vector<string>(++(vResult.begin()), vResult.end());
-        ++file_strLine;
     }
-    log_debug(LOG_ERR, "file count %d in file %s\n", file_strLine, strFile.c_str());
-    return 0;
 }
 
-void get_all_results(const vector< vector<string> > &vecAll, vector<string> &vOut)
+/*
+ * The deadline of a query, checked between small units of work. The clock
+ * is only read every DEADLINE_CHECK_INTERVAL checks, and once it is past
+ * the deadline every later check fails at once.
+ */
+#define DEADLINE_CHECK_INTERVAL 64
+
+class deadline_check
 {
-    if (vecAll.size() == 0)
+public:
+    deadline_check(uint64_t deadline)
+        : m_deadline(deadline), m_checks(0), m_expired(deadline != 0 && monotonic_msec() >= deadline)
     {
-        return;
     }
 
-    vOut = vecAll[0];
-
-    size_t uCount = vecAll.size();
-    for (size_t i = 1 ; i < uCount ; ++i)
+    bool expired()
     {
-        size_t uOutCount = vOut.size();
-        size_t uItemCount = vecAll[i].size();
-        for (size_t j = 0 ; j < uItemCount - 1 ; ++j)
+        if (m_deadline != 0 && !m_expired && ++m_checks % DEADLINE_CHECK_INTERVAL == 0)
         {
-            for (size_t k = 0 ; k < uOutCount ; ++k)
-            {
-                vOut.push_back(vOut[k]);
-            }
+            m_expired = monotonic_msec() >= m_deadline;
         }
+        return m_expired;
+    }
+
+private:
+    uint64_t m_deadline;
+    uint32_t m_checks;
+    bool m_expired;
+};
 
-        for (size_t j = 0 ; j < uItemCount ; ++j)
+static bool match_filter(const result_item &item, const vector<string> &filter_rule)
+{
+    for (size_t j = 0 ; j < filter_rule.size() ; ++j)
+    {
+        if (NULL == memmem(item.name, item.length, filter_rule[j].data(), filter_rule[j].size()))
         {
-            for (size_t k = j * uOutCount ; k < (j + 1) * uOutCount ; ++k)
-            {
-                vOut[k].append(vecAll[i][j]);
-            }
+            return false;
         }
     }
+    return true;
 }
 
-int all_english_char(const string &strIn)
+/*
+ * The names in a top-k heap, to drop a name stored under several keys
+ * (full pinyin, initials) in O(1). Open addressing with linear probing,
+ * sized once for the heap, and an erase that shifts the entries back
+ * instead of leaving tombstones.
+ */
+class name_set
 {
-    const unsigned char *p = reinterpret_cast<const unsigned char *>(strIn.c_str());
-    const unsigned char *pEnd = p + strIn.size();
-    while (p < pEnd)
+public:
+    explicit name_set(size_t max_items)
     {
-        if (*p >= 0x80)
+        size_t size = 16;
+        while (size < 2 * max_items)
         {
-            return 0;
+            size <<= 1;
         }
-        p++;
+        m_slots.resize(size);
+        m_mask = size - 1;
     }
-    return 1;
-}
 
-void convert_to_letters(const string &strIn, hashMap &hz2pyTable, vector<string> &vOut)
-{
-    vector< vector<string> > vecAll;
-    vOut.clear();
+    bool contains(const result_item &item) const
+    {
+        return m_slots[find(item, hash(item))].item.name != NULL;
+    }
 
-    if (all_english_char(strIn))
+    void insert(const result_item &item)
     {
-        vOut.push_back(strIn);
-        return;
+        uint32_t h = hash(item);
+        slot &s = m_slots[find(item, h)];
+        s.item = item;
+        s.hash = h;
     }
 
-    const char *p = strIn.c_str();
-    const char *pEnd = p + strIn.size();
-    while (p < pEnd)
+    void erase(const result_item &item)
     {
-        size_t s = getUTF8Len(p);
-        string strKey(p, s);
-        hashMap::iterator iter = hz2pyTable.find(strKey);
-        if (iter != hz2pyTable.end())
+        size_t i = find(item, hash(item));
+        if (m_slots[i].item.name == NULL)
         {
-            vecAll.push_back(iter->second);
+            return;
         }
-        p += s;
+        //move back the entries whose probe went past i
+        for (size_t j = (i + 1) & m_mask; m_slots[j].item.name != NULL; j = (j + 1) & m_mask)
+        {
+            size_t home = m_slots[j].hash & m_mask;
+            if (((j - home) & m_mask) >= ((j - i) & m_mask))
+            {
+                m_slots[i] = m_slots[j];
+                i = j;
+            }
+        }
+        m_slots[i].item.name = NULL;
     }
-    get_all_results(vecAll, vOut);
-}
 
-static void filter_result(const vector<NodeItem> &results, const vector<string> &filter_rule, vector<string> &vecResult, int nMaxNumToGet)
+private:
+    typedef struct slot
+    {
+        result_item item;   /* name is NULL in an empty slot */
+        uint32_t hash;
+    } slot;
+
+    static uint32_t hash(const result_item &item)
+    {
+        uint32_t h = 2166136261u;
+        for (uint32_t i = 0; i < item.length; ++i)
+        {
+            h = (h ^ (unsigned char)item.name[i]) * 16777619u;
+        }
+        return h;
+    }
+
+    //the slot of the name, or the empty slot ending its probe
+    size_t find(const result_item &item, uint32_t h) const
+    {
+        size_t i = h & m_mask;
+        while (m_slots[i].item.name != NULL && !(m_slots[i].hash == h && name_equal(m_slots[i].item, item)))
+        {
+            i = (i + 1) & m_mask;
+        }
+        return i;
+    }
+
+    vector<slot> m_slots;
+    size_t m_mask;
+};
+
+/*
+ * Keeps the nMaxNumToGet best ranked items (smallest rank) which pass the
+ * filter rule, as a heap built in place in the caller's result vector. It
+ * is fed by trie_type::getTopChildren(), which stops as soon as no subtree
+ * can beat the worst item we hold.
+ */
+class topk_collector
 {
-    set<NodeItem> resultSet;
-    vector<NodeItem> filter_results;
-    size_t resultnum = results.size();
-    size_t rulenum = filter_rule.size();
-    for (int i = 0 ; i < resultnum; ++i)
+public:
+    topk_collector(const vector<string> &filter_rule, size_t nMaxNumToGet, vector<result_item> &heap, deadline_check &deadline)
+        : m_filter_rule(filter_rule), m_max(nMaxNumToGet), m_heap(heap), m_names(nMaxNumToGet), m_deadline(deadline)
+    {
+        m_heap.clear();
+        m_heap.reserve(nMaxNumToGet);
+    }
+
+    dastrie::rank_type bound() const
+    {
+        //past the deadline no rank is worth visiting, which ends the walk
+        if (m_deadline.expired())
+        {
+            return -dastrie::worst_rank();
+        }
+        if (m_heap.size() < m_max)
+        {
+            return dastrie::worst_rank();
+        }
+        return m_heap.front().rank;
+    }
+
+    void add(const string_array_view &value)
     {
-        bool bFound = true;
-        for (size_t j = 0 ; j < rulenum ; ++j)
+        for (string_array_view::const_iterator it = value.begin(); it != value.end(); ++it)
         {
-            if (string::npos == results[i].strName.find(filter_rule[j]))
+            if (m_heap.size() >= m_max && !(it->rank < m_heap.front().rank))
+            {
+                continue;
+            }
+            if (m_names.contains(*it) || !match_filter(*it, m_filter_rule))
+            {
+                continue;
+            }
+            if (m_heap.size() >= m_max)
             {
-                bFound = false;
-                break;
+                pop_heap(m_heap.begin(), m_heap.end(), rank_compare);
+                m_names.erase(m_heap.back());
+                m_heap.pop_back();
             }
+            m_names.insert(*it);
+            m_heap.push_back(*it);
+            push_heap(m_heap.begin(), m_heap.end(), rank_compare);
         }
-        if (bFound)
+    }
+
+    //turn the heap into the final result list, best first
+    void finish()
+    {
+        sort_heap(m_heap.begin(), m_heap.end(), rank_compare);
+    }
+
+private:
+    const vector<string> &m_filter_rule;
+    size_t m_max;
+    vector<result_item> &m_heap;
+    name_set m_names;   /* the names in m_heap */
+    deadline_check &m_deadline;
+};
+
+static void filter_result(const vector<result_item> &results, const vector<string> &filter_rule, vector<result_item> &vecResult, int nMaxNumToGet)
+{
+    vector<result_item> filter_results;
+    size_t resultnum = results.size();
+    for (int i = 0 ; i < resultnum; ++i)
+    {
+        if (match_filter(results[i], filter_rule))
         {
-            resultSet.insert(results[i]);
+            filter_results.push_back(results[i]);
         }
     }
 
-    resultnum = 0;
-    for (set<NodeItem>::iterator it = resultSet.begin(); it != resultSet.end(); ++it)
+    //drop duplicated names, then order by rank
+    sort(filter_results.begin(), filter_results.end(), name_compare);
+    filter_results.erase(unique(filter_results.begin(), filter_results.end(), name_equal), filter_results.end());
+    resultnum = min(filter_results.size(), (size_t)nMaxNumToGet);
+
+    partial_sort(filter_results.begin(), filter_results.begin() + resultnum, filter_results.end(), rank_compare);
+    for (size_t i = 0 ; i < resultnum; ++i)
     {
-        filter_results.push_back(*it);
-        resultnum++;
+        vecResult.push_back(filter_results[i]);
     }
+    return;
+}
 
-    sort(filter_results.begin(), filter_results.end(), rank_compare);
-    for (size_t i = 0 ; i < resultnum && i < nMaxNumToGet; ++i)
+/* a pinyin prefix of the query found in the trie */
+typedef struct reading_node
+{
+    trie_type::size_type index;
+    string letters;
+} reading_node;
+
+/*
+ * Matches the readings of a query on the trie one syllable after another,
+ * so that a combination is dropped as soon as no key continues it instead
+ * of building the whole cartesian product first. Every syllable tried
+ * costs one unit of the budget.
+ */
+static void expand_readings(const trie_type &trie, const vector<reading> &readings, size_t pos,
+                            trie_type::size_type cur, trie_type::size_type matched, string &letters, int &budget,
+                            deadline_check &deadline, vector<reading_node> &nodes)
+{
+    if (pos == readings.size())
     {
-        vecResult.push_back(filter_results[i].strName);
+        reading_node node;
+        node.index = cur;
+        node.letters = letters;
+        nodes.push_back(node);
+        return;
     }
-    return;
+
+    const reading &r = readings[pos];
+    for (uint32_t i = 0; i < r.count && budget > 0 && !deadline.expired(); ++i)
+    {
+        --budget;
+        uint32_t syllable_length;
+        const char *syllable = pinyin_syllable(chinese_map, r.ids[i], syllable_length);
+        trie_type::size_type next_matched = matched;
+        trie_type::size_type next = trie.walk(cur, next_matched, syllable, syllable_length);
+        if (next == dastrie::INVALID_INDEX)
+        {
+            continue;
+        }
+
+        size_t length = letters.size();
+        letters.append(syllable, syllable_length);
+        expand_readings(trie, readings, pos + 1, next, next_matched, letters, budget, deadline, nodes);
+        letters.resize(length);
+    }
+}
+
+/*
+ * Feeds the collector with the items below one pinyin prefix. Short
+ * prefixes carry their best items in the index already (see the indexer's
+ * -D/-N options), which saves the walk over their large subtrees.
+ */
+static void collect_prefix(trie_type &trie, trie_type::size_type index, topk_collector &collector)
+{
+    string_array_view top;
+    if (trie.getTopValue(index, top))
+    {
+        collector.add(top);
+        //a short list holds every item of the subtree, a full one is enough
+        //when none of the items left out can beat the worst one we keep
+        if (top.size() < trie.topn() || (!top.empty() && collector.bound() <= top.back().rank))
+        {
+            return;
+        }
+    }
+    trie.getTopChildrenAt(index, collector);
 }
 
-int Query(const string &strQuery, vector<string> &vecResult, int nMaxNumToGet)
+/*
+ * Runs a query with the index pinned. On success the pin is kept so that
+ * the items, which point into the index, stay valid until Release().
+ * partial is set when the deadline stopped the query before it was done.
+ */
+int Query(const string &strQuery, vector<result_item> &vecResult, int nMaxNumToGet, uint64_t deadline, int &partial)
 {
-    size_t i = 0;
+    deadline_check check(deadline);
     const char *p = strQuery.c_str();
     const char *pEnd = p + strQuery.size();
     vector<string> vChinese;
     vector<trie_type::KeyValuePair> vResultTmp;
-    vector<NodeItem> vTmpNode;
-    vector<string> vLetters;
+    vector<result_item> vTmpNode;
+    vector<reading> vReadings;
+    vector<reading_node> vNodes;
+    int english = all_english_char(strQuery);
 
+    vecResult.clear();
     while (p < pEnd)
     {
-        i = getUTF8Len(p);
-        if (i == 1)
+        const char *q = p;
+        decode_utf8(p, pEnd);
+        if (p - q > 1)
         {
-            ++p;
-            continue;
+            vChinese.push_back(string(q, p - q));
         }
-        vChinese.push_back(string(p, i));
-        p += i;
     }
 
-    convert_to_letters(strQuery, chinese_map, vLetters);
-    if (vLetters.size() == 0)
+    //an english query is a key prefix as it is
+    if (!english)
+    {
+        uint64_t start = stats_now();
+        get_readings(strQuery, chinese_map, vReadings);
+        stats_record(STAGE_PINYIN, start);
+        if (vReadings.size() == 0)
+        {
+            log_debug(LOG_ERR, "the size of letters is 0\n");
+            return -1;
+        }
+    }
+
+    indexobj *index = pin_index();
+    if (index == NULL)
     {
-        log_debug(LOG_ERR, "the size of letters is 0\n");
         return -1;
     }
+    trie_type &trie = index->g_dasTrieObj;
 
-    pthread_rwlock_rdlock(&rwlock);
-    for (vector<string>::iterator it = vLetters.begin(); it != vLetters.end(); ++it)
+    uint64_t walk_start = stats_now();
+    string letters;
+    trie_type::size_type start = dastrie::INITIAL_INDEX;
+    trie_type::size_type matched = 0;
+    if (english)
     {
-        g_index.g_dasTrieObj.getChildren(it->c_str(), vResultTmp, g_settings.max_depth);
+        letters = strQuery;
+        start = trie.walk(start, matched, strQuery.data(), strQuery.size());
     }
-    pthread_rwlock_unlock(&rwlock);
-    for (vector<trie_type::KeyValuePair>::iterator vecIt = vResultTmp.begin(); vecIt != vResultTmp.end(); ++vecIt)
+    int budget = g_settings.max_expansions;
+    if (start != dastrie::INVALID_INDEX)
     {
-        for (string_array::iterator it = vecIt->value.begin(); it != vecIt->value.end(); ++it)
+        expand_readings(trie, vReadings, 0, start, matched, letters, budget, check, vNodes);
+    }
+    if (budget <= 0)
+    {
+        log_debug(LOG_NOTICE, "too many readings of %s, only %zu of them are used\n", strQuery.c_str(), vNodes.size());
+    }
+
+    if (trie.ranked())
+    {
+        //best-first walk over every pinyin reading, sharing one top-k heap
+        topk_collector collector(vChinese, nMaxNumToGet, vecResult, check);
+        for (vector<reading_node>::iterator it = vNodes.begin(); it != vNodes.end() && !check.expired(); ++it)
         {
-            vTmpNode.push_back(*it);
+            collect_prefix(trie, it->index, collector);
         }
+        collector.finish();
+        stats_record(STAGE_TRIE, walk_start);
+        partial = check.expired();
+        return 0;
+    }
+    //an index without ranks lists the keys in dictionary order, so the best
+    //nMaxNumToGet items can be anywhere among the max_depth candidates
+    auto stop = [&check]() { return check.expired(); };
+    for (vector<reading_node>::iterator it = vNodes.begin(); it != vNodes.end() && !check.expired(); ++it)
+    {
+        trie.getChildren(it->letters.c_str(), vResultTmp, g_settings.max_depth, stop);
+    }
+    for (vector<trie_type::KeyValuePair>::iterator vecIt = vResultTmp.begin(); vecIt != vResultTmp.end(); ++vecIt)
+    {
+        vTmpNode.insert(vTmpNode.end(), vecIt->value.begin(), vecIt->value.end());
     }
+    stats_record(STAGE_TRIE, walk_start);
 
+    uint64_t filter_start = stats_now();
     filter_result(vTmpNode, vChinese, vecResult, nMaxNumToGet);
+    stats_record(STAGE_FILTER, filter_start);
+    partial = check.expired();
     return 0;
 }
 
@@ -310,7 +645,7 @@ int init_index(char *index_file, indexobj &index)
     }
     close(ifd);
 
-    log_debug(LOG_ERR, index.index_file, MAX_FILE_LEN, "%s", index_file);
+    snprintf(index.index_file, MAX_FILE_LEN, "%s", index_file);
     index.mem = mem;
     index.fsize = fsize;
 
@@ -327,31 +662,43 @@ int deinit_index(indexobj &index)
 {
     int ret = munmap(index.mem, index.fsize);
     index.mem = NULL;
+    return ret;
 }
 
 int Init_Index(char *py_file, char *index_file)
 {
     int ret = 0;
-    if (0 != read_chinese_map(py_file, chinese_map))
+    if (0 != pinyin_map_load(py_file, chinese_map))
     {
+        log_debug(LOG_ERR, "load the pinyin map %s failed\n", py_file);
         return -1;
     }
-    if (init_index(index_file, g_index) != 0)
+    log_debug(LOG_ERR, "pinyin map of %u codepoints, %u syllables loaded from %s\n", chinese_map.count, chinese_map.nsyllables, py_file);
+    indexobj *index = new indexobj;
+    if (init_index(index_file, *index) != 0)
     {
+        delete index;
         return -1;
     }
+    __atomic_store_n(&g_current, index, __ATOMIC_SEQ_CST);
     return 0;
 }
 
 int Deinit_Index()
 {
-    deinit_index(g_index);
+    indexobj *index = __atomic_exchange_n(&g_current, (indexobj *)NULL, __ATOMIC_SEQ_CST);
+    if (index != NULL)
+    {
+        deinit_index(*index);
+        delete index;
+    }
     return 0;
 }
 
 int exiting()
 {
-    g_exiting = 1;
+    __atomic_store_n(&g_state, INDEX_EXITING, __ATOMIC_SEQ_CST);
+    return 0;
 }
 
 int Reload_index(char *newindex_file)
@@ -363,43 +710,80 @@ int Reload_index(char *newindex_file)
     }
 
     int ret = 0;
-    indexobj new_index;
-    indexobj prev_index = g_index;
 
-    if (g_reloading == 1)
+    //the previous reload may still wait for its readers, give them a second
+    for (int i = 0; i < 1000; ++i)
+    {
+        reclaim_index();
+        if (__atomic_load_n(&g_state, __ATOMIC_ACQUIRE) != INDEX_DRAINING)
+        {
+            break;
+        }
+        mysleep_millisec(1);
+    }
+    if (!__sync_bool_compare_and_swap(&g_state, INDEX_IDLE, INDEX_LOADING))
     {
         log_debug(LOG_NOTICE, "it is in reloading now\n");
         return -1;
     }
-    g_reloading = 1;
 
     //load new index
-    ret = init_index(newindex_file, new_index);
+    uint64_t start = stats_now();
+    indexobj *new_index = new indexobj;
+    ret = init_index(newindex_file, *new_index);
     if (ret != 0)
     {
         log_debug(LOG_NOTICE, "call init index error, ret:%d\n", ret);
-        g_reloading = 0;
+        __atomic_store_n(&g_reload_failures, g_reload_failures + 1, __ATOMIC_RELAXED);
+        delete new_index;
+        __sync_bool_compare_and_swap(&g_state, INDEX_LOADING, INDEX_IDLE);
         return -1;
     }
 
-    //switch it
-    pthread_rwlock_wrlock(&rwlock);
-    g_index = new_index;
-    pthread_rwlock_unlock(&rwlock);
-
-    //release old index and reset flag
-    deinit_index(prev_index);
-    g_reloading = 0;
+    //switch it, the old one goes once its readers are gone
+    indexobj *prev_index = __atomic_exchange_n(&g_current, new_index, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&g_generation, 1, __ATOMIC_SEQ_CST);
+    cache_clear();
+    __atomic_store_n(&g_last_reload_nsec, stats_now() - start, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_reloads, g_reloads + 1, __ATOMIC_RELAXED);
+    if (prev_index == NULL)
+    {
+        __sync_bool_compare_and_swap(&g_state, INDEX_LOADING, INDEX_IDLE);
+    }
+    else
+    {
+        __atomic_store_n(&g_retired, prev_index, __ATOMIC_SEQ_CST);
+        __sync_bool_compare_and_swap(&g_state, INDEX_LOADING, INDEX_DRAINING);
+        reclaim_index();
+    }
 
     log_debug(LOG_NOTICE, "read new index %s successfully\n", newindex_file);
     return 0;
 }
 
-int Get(string line, vector<string> &vRes)
+void Get_Index_Stats(index_stats &stats)
 {
-    if (g_exiting == 1)
+    memset(&stats, 0, sizeof(stats));
+    indexobj *index = pin_index();
+    if (index != NULL)
+    {
+        stats.records = index->g_dasTrieObj.size();
+        stats.bytes = index->fsize;
+        unpin_index();
+    }
+    stats.reloads = __atomic_load_n(&g_reloads, __ATOMIC_RELAXED);
+    stats.reload_failures = __atomic_load_n(&g_reload_failures, __ATOMIC_RELAXED);
+    stats.last_reload_nsec = __atomic_load_n(&g_last_reload_nsec, __ATOMIC_RELAXED);
+}
+
+int Get(string line, int number, query_result &res, uint64_t deadline)
+{
+    res.items.clear();
+    res.pinned = 0;
+    res.cached = NULL;
+    res.partial = 0;
+    if (__atomic_load_n(&g_state, __ATOMIC_RELAXED) == INDEX_EXITING)
     {
-        vRes.clear();
         return 0;
     }
 
@@ -410,13 +794,56 @@ int Get(string line, vector<string> &vRes)
         return -1;
     }
     line = trim(line, " \t\r", 1);
-    ret = Query(line, vRes, g_settings.max_depth);
+    if (number <= 0 || number > g_settings.max_depth)
+    {
+        number = g_settings.max_depth;
+    }
+
+    //results of an older index are never returned, see Reload_index()
+    char count[16];
+    snprintf(count, sizeof(count), "%d", number);
+    string key(line);
+    key.push_back('\0');
+    key.append(count);
+    uint64_t generation = __atomic_load_n(&g_generation, __ATOMIC_SEQ_CST);
+    res.cached = cache_get(key, generation, res.items);
+    if (res.cached != NULL)
+    {
+        log_debug(LOG_NOTICE, "input key: %s, cached\n", line.c_str());
+        return 0;
+    }
+
+    ret = Query(line, res.items, number, deadline, res.partial);
+    if (ret == 0)
+    {
+        res.pinned = 1;
+        //a cut short result would hide the full one from later queries
+        if (!res.partial)
+        {
+            cache_set(key, generation, res.items);
+        }
+    }
     log_debug(LOG_NOTICE, "input key: %s, return: %d\n", line.c_str(), ret);
     return ret;
 }
 
+void Release(query_result &res)
+{
+    res.items.clear();
+    if (res.cached)
+    {
+        cache_release(res.cached);
+        res.cached = NULL;
+    }
+    if (res.pinned)
+    {
+        res.pinned = 0;
+        unpin_index();
+    }
+}
+
 #ifdef TEST
-//g++ prefixmatch.cpp util.cpp config.cpp  -DTEST -g --std=c++0x -lpthread
+//g++ prefixmatch.cpp pinyin.cpp cache.cpp util.cpp config.cpp  -DTEST -g --std=c++0x -lpthread
 int main(int argc, char **argv)
 {
     if (argc != 4)
@@ -441,19 +868,20 @@ int main(int argc, char **argv)
     cout << "line: " << line << endl;
     ifs.close();
 
-    vector<string> vRes;
-    ret = Get(line, vRes);
+    query_result res;
+    ret = Get(line, 0, res);
     if (ret != 0)
     {
         cout << "call Get error" << endl;
         return -1;
     }
 
-    for (int i = 0; i < vRes.size(); i++)
+    for (int i = 0; i < res.items.size(); i++)
     {
-        cout << vRes[i] << " ";
+        cout << string(res.items[i].name, res.items[i].length) << " ";
     }
     cout << endl;
+    Release(res);
 
     return 0;
 }
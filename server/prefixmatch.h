@@ -20,9 +20,44 @@
 
 using namespace std;
 
+/* a result of a query, pointing into the index memory */
+typedef struct result_item
+{
+    const char *name;   /* not null-terminated in general, use length */
+    uint32_t    length;
+    float       rank;
+} result_item;
+
+struct cache_entry;
+
+typedef struct query_result
+{
+    vector<result_item> items;
+    int pinned;         /* the items are valid until Release() */
+    struct cache_entry *cached; /* set when the items point into the query cache */
+    int partial;        /* the deadline ran out, the items are the best found until then */
+} query_result;
+
 int Init_Index(char *py_file, char *index_file);
 int Deinit_Index();
-int Get(string line, vector<string> &vRes);
+/*
+ * at most number items, up to max_depth; 0 for max_depth.
+ * deadline is a monotonic_msec() time, 0 for none.
+ */
+int Get(string line, int number, query_result &res, uint64_t deadline = 0);
+void Release(query_result &res);
 int Reload_index(char *newindex_file);
+
+typedef struct index_stats
+{
+    uint64_t records;           /* keys of the current index */
+    uint64_t bytes;             /* size of its file */
+    uint64_t reloads;           /* indexes swapped in by Reload_index() */
+    uint64_t reload_failures;
+    uint64_t last_reload_nsec;  /* time the last swap took to load */
+} index_stats;
+
+/* reads the current index pinned, it never waits for a reload */
+void Get_Index_Stats(index_stats &stats);
 int exiting();
 #endif
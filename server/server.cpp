@@ -15,6 +15,9 @@
 #include "log.h"
 #include "sig.h"
 #include "prefixmatch.h"
+#include "cache.h"
+#include "compute.h"
+#include "stats.h"
 
 #define IOV_MAX 1024
 
@@ -37,6 +40,7 @@ static void write_and_free(conn *c, char *buf, int bytes);
 static int ensure_iov_space(conn *c);
 static int add_iov(conn *c, const void *buf, int len);
 static int add_msghdr(conn *c);
+static int build_udp_headers(conn *c);
 
 static void usage(void)
 {
@@ -93,6 +97,12 @@ static int add_msghdr(conn *c)
     c->msgbytes = 0;
     c->msgused++;
 
+    if (IS_UDP(c->transport))
+    {
+        /* Leave room for the UDP header, which we'll fill in later. */
+        return add_iov(c, NULL, UDP_HEADER_SIZE);
+    }
+
     return 0;
 }
 
@@ -152,7 +162,7 @@ static int add_iov(conn *c, const void *buf, int len)
          * Limit UDP packets, and the first payloads of TCP replies, to
          * UDP_MAX_PAYLOAD_SIZE bytes.
          */
-        limit_to_mtu = (1 == c->msgused);
+        limit_to_mtu = IS_UDP(c->transport) || (1 == c->msgused);
 
         /* We may need to start a new msghdr if this one is full. */
         if (m->msg_iovlen == IOV_MAX ||
@@ -229,7 +239,45 @@ void out_string(conn *c, const char *str)
     return;
 }
 
-static void add_bin_header(conn *c, uint16_t err, uint32_t body_len)
+/*
+ * Fills in the frame header of every datagram of a UDP reply: the request
+ * id, the sequence number of the datagram and the number of datagrams.
+ */
+static int build_udp_headers(conn *c)
+{
+    unsigned char *hdr;
+
+    assert(c != NULL);
+
+    if (c->msgused > c->hdrsize)
+    {
+        void *new_hdrbuf = realloc(c->hdrbuf, c->msgused * 2 * UDP_HEADER_SIZE);
+        if (!new_hdrbuf)
+        {
+            return -1;
+        }
+        c->hdrbuf = (unsigned char *)new_hdrbuf;
+        c->hdrsize = c->msgused * 2;
+    }
+
+    hdr = c->hdrbuf;
+    for (int i = 0; i < c->msgused; i++)
+    {
+        c->msglist[i].msg_iov[0].iov_base = (void *)hdr;
+        c->msglist[i].msg_iov[0].iov_len = UDP_HEADER_SIZE;
+        *hdr++ = c->request_id / 256;
+        *hdr++ = c->request_id % 256;
+        *hdr++ = i / 256;
+        *hdr++ = i % 256;
+        *hdr++ = c->msgused / 256;
+        *hdr++ = c->msgused % 256;
+        *hdr++ = 0;
+        *hdr++ = 0;
+    }
+    return 0;
+}
+
+static void add_bin_header(conn *c, uint8_t err, uint32_t body_len)
 {
     response_header *header;
 
@@ -247,7 +295,7 @@ static void add_bin_header(conn *c, uint16_t err, uint32_t body_len)
 
     header = (response_header *)c->wbuf;
     header->response.magic = (uint8_t)RES;
-    header->response.status = (uint16_t)htons(err);
+    header->response.status = (uint8_t)err;
     header->response.bodylen = htonl(body_len);
 
     if (g_settings.verbose > 1)
@@ -268,6 +316,16 @@ static void add_bin_header(conn *c, uint16_t err, uint32_t body_len)
     add_iov(c, c->wbuf, sizeof(header->response));
 }
 
+/* counts a reply for the monitor, which may be built on the compute pool */
+static void count_reply(conn *c, uint8_t status, uint32_t results)
+{
+    if (c->thread != NULL)
+    {
+        __atomic_add_fetch(&c->thread->responses[status], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->thread->results, results, __ATOMIC_RELAXED);
+    }
+}
+
 static void write_bin_error(conn *c, response_status err, int swallow)
 {
     const char *errstr = "Unknown error";
@@ -278,6 +336,12 @@ static void write_bin_error(conn *c, response_status err, int swallow)
         case RESPONSE_ENOMEM:
             errstr = "Out of memory";
             break;
+        case RESPONSE_EINVAL:
+            errstr = "Invalid arguments";
+            break;
+        case RESPONSE_UNKNOWN_COMMAND:
+            errstr = "Unknown command";
+            break;
         default:
             assert(false);
             errstr = "UNHANDLED ERROR";
@@ -289,6 +353,7 @@ static void write_bin_error(conn *c, response_status err, int swallow)
         log_debug(LOG_ERR, ">%d Writing an error: %s\n", c->sfd, errstr);
     }
 
+    count_reply(c, err, 0);
     len = strlen(errstr);
     add_bin_header(c, err, len);
     if (len > 0)
@@ -308,9 +373,9 @@ static void write_bin_error(conn *c, response_status err, int swallow)
 }
 
 /* Form and send a response to a command over the binary protocol */
-static void write_bin_response(conn *c, void *d, int dlen)
+static void write_bin_response(conn *c, uint8_t status, void *d, int dlen)
 {
-    add_bin_header(c, 0, dlen);
+    add_bin_header(c, status, dlen);
     if (dlen > 0)
     {
         add_iov(c, d, dlen);
@@ -348,73 +413,243 @@ static void *get_request(conn *c)
 
 #define DEFAULT_GET_NUMBER 10
 
-static void complete_nread(conn *c)
+/*
+ * Clamps number to the items there are and to what still fits in the reply,
+ * rlen being the bytes it already has. Adds the size of the block to rlen.
+ */
+static uint32_t fit_result_block(const vector<result_item> &vRes, uint32_t number, int &rlen)
 {
-    char *data;
-    uint32_t vlen;
-
-    assert(c != NULL);
+    if (number > vRes.size())
+    {
+        number = vRes.size();
+    }
+    rlen += sizeof(uint32_t);
+    for (uint32_t i = 0; i < number; i++)
+    {
+        int size = sizeof(uint32_t) + vRes[i].length;
+        if (rlen + size > g_settings.max_response_size)
+        {
+            log_debug(LOG_NOTICE, "reply truncated to %u of %u items\n", i, number);
+            return i;
+        }
+        rlen += size;
+    }
+    return number;
+}
 
-    vlen = c->binary_header.request.bodylen;
-    data = (char *)c->ritem - vlen;
+static char *put_result_block(char *tbuf, const vector<result_item> &vRes, uint32_t number)
+{
+#define set_value(ptr, valueptr, size) do {\
+        memcpy(tbuf, valueptr, size); \
+        tbuf += size;\
+    }while(0)
 
-    if (g_settings.verbose > 1)
+    set_value(tbuf, &number, sizeof(number));
+    for (uint32_t i = 0; i < number; i++)
     {
-        log_debug(LOG_ERR, "Value len is %d\n", vlen);
+        uint32_t length = vRes[i].length;
+        set_value(tbuf, &length, sizeof(length));
+        set_value(tbuf, vRes[i].name, length);
     }
+    return tbuf;
+#undef set_value
+}
 
-    uint32_t number = *(uint32_t *)data;
+static void process_bin_get(conn *c, char *data, uint32_t vlen)
+{
+    if (vlen < sizeof(uint32_t))
+    {
+        write_bin_error(c, RESPONSE_EINVAL, 0);
+        return;
+    }
+    uint32_t number;
+    memcpy(&number, data, sizeof(number));
     data += sizeof(uint32_t);
     string key(data, 0, vlen - sizeof(uint32_t));
-    vector<string> vRes;
-    int ret = Get(key, vRes);
+    if (number == 0)
+    {
+        number = DEFAULT_GET_NUMBER;
+    }
+
+    query_result res;
+    vector<result_item> &vRes = res.items;
+    int ret = Get(key, number, res, c->deadline);
     if (ret != 0)
     {
         log_debug(LOG_ERR, "Fail to get result for key:%s\n", key.c_str());
         write_bin_error(c, RESPONSE_ENOMEM, 0);
         return;
     }
+    uint8_t status = res.partial ? RESPONSE_PARTIAL : RESPONSE_SUCCESS;
 
-    if (number == 0)
+    uint64_t start = stats_now();
+    int rlen = 0;
+    number = fit_result_block(vRes, number, rlen);
+    char *resp_buf = conn_reply_buffer(c, rlen);
+    if (resp_buf == NULL)
     {
-        number = DEFAULT_GET_NUMBER;
+        Release(res);
+        log_debug(LOG_ERR, "fail to malloc memory\n");
+        write_bin_error(c, RESPONSE_ENOMEM, 0);
+        return;
     }
-    if (number > vRes.size())
+    put_result_block(resp_buf, vRes, number);
+    Release(res);
+    stats_record(STAGE_SERIALIZE, start);
+
+    count_reply(c, status, number);
+    write_bin_response(c, status, resp_buf, rlen);
+}
+
+/*
+ * Answers every key of the batch in this one pass, the queries stay pinned
+ * until the reply has been copied out.
+ */
+static void process_bin_mget(conn *c, char *data, uint32_t vlen)
+{
+    vector<uint32_t> numbers;
+    vector<query_result> results;
+    char *end = data + vlen;
+    int rlen = 0;
+    int ret = 0;
+    uint8_t status = RESPONSE_SUCCESS;
+
+    while (data < end)
     {
-        number = vRes.size();
+        uint32_t number, klen;
+        if (end - data < (ptrdiff_t)(2 * sizeof(uint32_t)))
+        {
+            ret = -1;
+            break;
+        }
+        memcpy(&number, data, sizeof(number));
+        memcpy(&klen, data + sizeof(number), sizeof(klen));
+        data += 2 * sizeof(uint32_t);
+        if ((uint32_t)(end - data) < klen)
+        {
+            ret = -1;
+            break;
+        }
+        string key(data, klen);
+        data += klen;
+        if (number == 0)
+        {
+            number = DEFAULT_GET_NUMBER;
+        }
+
+        results.push_back(query_result());
+        query_result &res = results.back();
+        if (Get(key, number, res, c->deadline) != 0)
+        {
+            //an empty block, the other keys are still answered
+            log_debug(LOG_ERR, "Fail to get result for key:%s\n", key.c_str());
+            res.items.clear();
+        }
+        if (res.partial)
+        {
+            status = RESPONSE_PARTIAL;
+        }
+        numbers.push_back(fit_result_block(res.items, number, rlen));
     }
 
-    int rlen = sizeof(uint32_t);
-    for (int i = 0; i < vRes.size(); i++)
+    uint64_t start = stats_now();
+    char *resp_buf = NULL;
+    if (ret == 0 && !results.empty())
+    {
+        resp_buf = conn_reply_buffer(c, rlen);
+    }
+    char *tbuf = resp_buf;
+    uint32_t items = 0;
+    for (size_t k = 0; k < results.size(); k++)
+    {
+        if (tbuf != NULL)
+        {
+            tbuf = put_result_block(tbuf, results[k].items, numbers[k]);
+            items += numbers[k];
+        }
+        Release(results[k]);
+    }
+    if (resp_buf != NULL)
     {
-        rlen += sizeof(uint32_t);
-        rlen += vRes[i].length();
+        stats_record(STAGE_SERIALIZE, start);
     }
 
-    char *resp_buf = (char *)calloc(1, rlen + 1);
+    if (ret != 0 || results.empty())
+    {
+        log_debug(LOG_ERR, "Malformed mget request of %u bytes\n", vlen);
+        write_bin_error(c, RESPONSE_EINVAL, 0);
+        return;
+    }
     if (resp_buf == NULL)
     {
         log_debug(LOG_ERR, "fail to malloc memory\n");
         write_bin_error(c, RESPONSE_ENOMEM, 0);
         return;
     }
-    char *tbuf = resp_buf;
 
-#define set_value(ptr, valueptr, size) do {\
-        memcpy(tbuf, valueptr, size); \
-        tbuf += size;\
-    }while(0)
+    count_reply(c, status, items);
+    write_bin_response(c, status, resp_buf, rlen);
+}
 
-    set_value(tbuf, &number, sizeof(number));
-    for (int i = 0; i < vRes.size(); i++)
+static void process_bin_command(conn *c)
+{
+    uint32_t vlen = c->binary_header.request.bodylen;
+    char *data = (char *)c->ritem - vlen;
+
+    switch (c->cmd)
     {
-        uint32_t length = vRes[i].length();
-        set_value(tbuf, &length, sizeof(length));
-        set_value(tbuf, vRes[i].c_str(), length);
+        case CMD_GET:
+            process_bin_get(c, data, vlen);
+            break;
+        case CMD_MGET:
+            process_bin_mget(c, data, vlen);
+            break;
+        default:
+            log_debug(LOG_ERR, "Unknown binary command: %d\n", c->cmd);
+            write_bin_error(c, RESPONSE_UNKNOWN_COMMAND, 0);
+            break;
+    }
+}
+
+/* runs on the compute pool, the worker does not touch c until it is posted back */
+static void compute_bin_command(void *arg)
+{
+    conn *c = (conn *)arg;
+    process_bin_command(c);
+    thread_post_done(c->thread, c);
+}
+
+static void complete_nread(conn *c)
+{
+    assert(c != NULL);
+
+    if (g_settings.verbose > 1)
+    {
+        log_debug(LOG_ERR, "Value len is %d\n", c->binary_header.request.bodylen);
+    }
+
+    if (c->thread != NULL)
+    {
+        __atomic_store_n(&c->thread->requests, c->thread->requests + 1, __ATOMIC_RELAXED);
+    }
+
+    if (compute_enabled() && c->thread != NULL)
+    {
+        /* nothing is read from the socket until the reply is ready */
+        if (!update_event(c, 0))
+        {
+            if (g_settings.verbose > 0)
+            {
+                log_debug(LOG_ERR, "Couldn't update event\n");
+            }
+            conn_set_state(c, conn_closing);
+            return;
+        }
+        conn_set_state(c, conn_compute);
+        return;
     }
 
-    c->write_and_free = resp_buf;
-    write_bin_response(c, resp_buf, rlen);
+    process_bin_command(c);
 }
 
 /* set up a connection to write a buffer then free it, used for stats */
@@ -546,6 +781,28 @@ int try_read_command(conn *c)
 
         c->binary_header = *req;
         c->binary_header.request.bodylen = ntohl(req->request.bodylen);
+        c->binary_header.request.timeout = ntohs(req->request.timeout);
+
+        int timeout = c->binary_header.request.timeout;
+        if (timeout == 0)
+        {
+            timeout = g_settings.request_timeout;
+        }
+        c->deadline = timeout > 0 ? monotonic_msec() + timeout : 0;
+
+        if (IS_UDP(c->transport) &&
+            c->binary_header.request.bodylen > c->rbytes - sizeof(c->binary_header))
+        {
+            /* the rest of the body would be the next datagram, drop it all */
+            if (g_settings.verbose)
+            {
+                log_debug(LOG_ERR, "UDP request body of %u bytes is not in its datagram\n",
+                          c->binary_header.request.bodylen);
+            }
+            c->rbytes = 0;
+            conn_set_state(c, conn_new_cmd);
+            return 1;
+        }
 
         c->msgcurr = 0;
         c->msgused = 0;
@@ -591,9 +848,12 @@ static enum transmit_result transmit(conn *c)
         ssize_t res;
         struct msghdr *m = &c->msglist[c->msgcurr];
 
+        uint64_t start = stats_now();
         res = sendmsg(c->sfd, m, 0);
+        stats_record(STAGE_TRANSMIT, start);
         if (res > 0)
         {
+            thread_count(&c->thread->bytes_written, res);
             /* We've written some of the data. Remove the completed
                iovec entries from the list of pending writes. */
             while (m->msg_iovlen > 0 && res >= m->msg_iov->iov_len)
@@ -694,8 +954,26 @@ void drive_machine(conn *c)
                 }
 
                 log_debug(LOG_NOTICE, "get a new connection\n");
-                dispatch_conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
-                                  DATA_BUFFER_SIZE, tcp_transport);
+                if (c->thread != NULL)
+                {
+                    /* a worker's own SO_REUSEPORT socket, the connection stays on the worker */
+                    conn *nc = conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
+                                        DATA_BUFFER_SIZE, tcp_transport, c->thread->base);
+                    if (nc == NULL)
+                    {
+                        close(sfd);
+                    }
+                    else
+                    {
+                        nc->thread = c->thread;
+                        __sync_add_and_fetch(&c->thread->active_conns, 1);
+                    }
+                }
+                else
+                {
+                    dispatch_conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
+                                      DATA_BUFFER_SIZE, tcp_transport);
+                }
                 stop = true;
                 break;
 
@@ -715,7 +993,7 @@ void drive_machine(conn *c)
                 break;
 
             case conn_read:
-                res = try_read_network(c);
+                res = IS_UDP(c->transport) ? try_read_udp(c) : try_read_network(c);
 
                 switch (res)
                 {
@@ -735,11 +1013,18 @@ void drive_machine(conn *c)
                 break;
 
             case conn_parse_cmd :
+            {
+                uint64_t start = stats_now();
                 if (try_read_command(c) == 0)
                 {
                     /* wee need more data! */
                     conn_set_state(c, conn_waiting);
                 }
+                else
+                {
+                    stats_record(STAGE_READ, start);
+                }
+            }
 
                 break;
 
@@ -802,6 +1087,7 @@ void drive_machine(conn *c)
                 res = read(c->sfd, c->ritem, c->rlbytes);
                 if (res > 0)
                 {
+                    thread_count(&c->thread->bytes_read, res);
                     if (c->rcurr == c->ritem)
                     {
                         c->rcurr += res;
@@ -864,6 +1150,7 @@ void drive_machine(conn *c)
                 res = read(c->sfd, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
                 if (res > 0)
                 {
+                    thread_count(&c->thread->bytes_read, res);
                     c->sbytes -= res;
                     break;
                 }
@@ -900,7 +1187,7 @@ void drive_machine(conn *c)
                  * assemble it into a msgbuf list (this will be a single-entry
                  * list for TCP or a two-entry list for UDP).
                  */
-                if (c->iovused == 0)
+                if (c->iovused == 0 || (IS_UDP(c->transport) && c->iovused == 1))
                 {
                     if (add_iov(c, c->wcurr, c->wbytes) != 0)
                     {
@@ -916,6 +1203,15 @@ void drive_machine(conn *c)
                 /* fall through... */
 
             case conn_mwrite:
+                if (IS_UDP(c->transport) && c->msgcurr == 0 && build_udp_headers(c) != 0)
+                {
+                    if (g_settings.verbose > 0)
+                    {
+                        log_debug(LOG_ERR, "Failed to build UDP headers\n");
+                    }
+                    conn_set_state(c, conn_closing);
+                    break;
+                }
                 switch (transmit(c))
                 {
                     case TRANSMIT_COMPLETE:
@@ -926,15 +1222,7 @@ void drive_machine(conn *c)
                                 free(c->write_and_free);
                                 c->write_and_free = 0;
                             }
-                            /*
-                                        if (c->protocol == binary_prot)
-                                        {
-                                                conn_set_state(c, c->write_and_go);
-                                        }*/
-                            else
-                            {
-                                conn_set_state(c, conn_new_cmd);
-                            }
+                            conn_set_state(c, conn_new_cmd);
                         }
                         else if (c->state == conn_write)
                         {
@@ -965,7 +1253,21 @@ void drive_machine(conn *c)
                 }
                 break;
 
+            case conn_compute:
+                /* the reply is written when the pool posts c back to us */
+                stop = true;
+                compute_submit(c->thread->index, compute_bin_command, c);
+                break;
+
             case conn_closing:
+                if (IS_UDP(c->transport))
+                {
+                    /* the socket serves every UDP client, only this request is dropped */
+                    conn_cleanup(c);
+                    c->rbytes = 0;
+                    conn_set_state(c, conn_new_cmd);
+                    break;
+                }
                 conn_close(c);
                 stop = true;
                 break;
@@ -979,17 +1281,149 @@ void drive_machine(conn *c)
     return;
 }
 
-static struct evhttp *http;
-static struct evhttp_bound_socket *handle;
+/*
+ * The http monitor runs its own event bases, one per monitor thread, all
+ * accepting on the one listening socket, so it neither waits on nor
+ * delays the main thread.
+ */
+typedef struct http_thread
+{
+    pthread_t thread_id;
+    struct event_base *base;
+    struct evhttp *http;
+} http_thread;
+
+static http_thread *http_threads;
+
+/* appends s as a JSON string, the names are utf8 already */
+static void evbuffer_add_json_string(struct evbuffer *evb, const char *s, size_t len)
+{
+    const char *run = s;
+
+    evbuffer_add(evb, "\"", 1);
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char ch = s[i];
+        if (ch >= 0x20 && ch != '"' && ch != '\\')
+        {
+            continue;
+        }
+        evbuffer_add(evb, run, s + i - run);
+        if (ch == '"' || ch == '\\')
+        {
+            evbuffer_add_printf(evb, "\\%c", ch);
+        }
+        else
+        {
+            evbuffer_add_printf(evb, "\\u%04x", ch);
+        }
+        run = s + i + 1;
+    }
+    evbuffer_add(evb, run, s + len - run);
+    evbuffer_add(evb, "\"", 1);
+}
+
+static void add_metric_header(struct evbuffer *evb, const char *name, const char *type, const char *help)
+{
+    evbuffer_add_printf(evb, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * The /metrics page in the Prometheus text format. Every number is read
+ * with a relaxed load or from a pinned index, the workers are never
+ * waited for.
+ */
+static void add_metrics(struct evbuffer *evb)
+{
+    static const struct
+    {
+        uint8_t status;
+        const char *name;
+    } statuses[] =
+    {
+        {RESPONSE_SUCCESS, "success"},
+        {RESPONSE_EINVAL, "einval"},
+        {RESPONSE_PARTIAL, "partial"},
+        {RESPONSE_UNKNOWN_COMMAND, "unknown_command"},
+        {RESPONSE_ENOMEM, "enomem"},
+    };
+    int nthreads = g_settings.num_threads;
+    vector<thread_load> loads(nthreads);
+    for (int i = 0; i < nthreads; i++)
+    {
+        thread_get_load(i, &loads[i]);
+    }
+
+    add_metric_header(evb, "prefixmatch_requests_total", "counter", "Requests read by each worker.");
+    for (int i = 0; i < nthreads; i++)
+    {
+        evbuffer_add_printf(evb, "prefixmatch_requests_total{thread=\"%d\"} %" PRIu64 "\n", i, loads[i].requests);
+    }
+    add_metric_header(evb, "prefixmatch_responses_total", "counter", "Replies of each worker by response status.");
+    for (int i = 0; i < nthreads; i++)
+    {
+        for (size_t s = 0; s < sizeof(statuses) / sizeof(statuses[0]); s++)
+        {
+            evbuffer_add_printf(evb, "prefixmatch_responses_total{thread=\"%d\",status=\"%s\"} %" PRIu64 "\n",
+                                i, statuses[s].name, loads[i].responses[statuses[s].status]);
+        }
+    }
+    add_metric_header(evb, "prefixmatch_results_total", "counter", "Items in the replies of each worker.");
+    for (int i = 0; i < nthreads; i++)
+    {
+        evbuffer_add_printf(evb, "prefixmatch_results_total{thread=\"%d\"} %" PRIu64 "\n", i, loads[i].results);
+    }
+    add_metric_header(evb, "prefixmatch_read_bytes_total", "counter", "Bytes read from the clients of each worker.");
+    for (int i = 0; i < nthreads; i++)
+    {
+        evbuffer_add_printf(evb, "prefixmatch_read_bytes_total{thread=\"%d\"} %" PRIu64 "\n", i, loads[i].bytes_read);
+    }
+    add_metric_header(evb, "prefixmatch_written_bytes_total", "counter", "Bytes written to the clients of each worker.");
+    for (int i = 0; i < nthreads; i++)
+    {
+        evbuffer_add_printf(evb, "prefixmatch_written_bytes_total{thread=\"%d\"} %" PRIu64 "\n", i, loads[i].bytes_written);
+    }
+    add_metric_header(evb, "prefixmatch_active_connections", "gauge", "Connections served by each worker.");
+    for (int i = 0; i < nthreads; i++)
+    {
+        evbuffer_add_printf(evb, "prefixmatch_active_connections{thread=\"%d\"} %d\n", i, loads[i].active_conns);
+    }
+    add_metric_header(evb, "prefixmatch_free_connections", "gauge", "Connection structures in the freelist.");
+    evbuffer_add_printf(evb, "prefixmatch_free_connections %d\n", conn_freelist_size());
+
+    index_stats index;
+    Get_Index_Stats(index);
+    add_metric_header(evb, "prefixmatch_index_records", "gauge", "Keys of the current index.");
+    evbuffer_add_printf(evb, "prefixmatch_index_records %" PRIu64 "\n", index.records);
+    add_metric_header(evb, "prefixmatch_index_bytes", "gauge", "Size of the current index file.");
+    evbuffer_add_printf(evb, "prefixmatch_index_bytes %" PRIu64 "\n", index.bytes);
+    add_metric_header(evb, "prefixmatch_index_reloads_total", "counter", "Indexes swapped in by a reload.");
+    evbuffer_add_printf(evb, "prefixmatch_index_reloads_total %" PRIu64 "\n", index.reloads);
+    add_metric_header(evb, "prefixmatch_index_reload_failures_total", "counter", "Reloads whose index could not be loaded.");
+    evbuffer_add_printf(evb, "prefixmatch_index_reload_failures_total %" PRIu64 "\n", index.reload_failures);
+    add_metric_header(evb, "prefixmatch_index_last_reload_seconds", "gauge", "Time the last reload took to load its index.");
+    evbuffer_add_printf(evb, "prefixmatch_index_last_reload_seconds %.6f\n", index.last_reload_nsec / 1e9);
+
+    add_metric_header(evb, "prefixmatch_log_dropped_total", "counter", "Log messages dropped because a log ring was full.");
+    evbuffer_add_printf(evb, "prefixmatch_log_dropped_total %" PRIu64 "\n", log_dropped());
+}
 
 /* http_cb
- * support 2 operations: get, reload
+ * support 5 operations: get, reload, cache, threads, stats
  * in get operation, need 2 parameters:
  *  key, number
+ * the get result is json: {"key":"zhang","items":["...", ...]}, with
+ * "partial":true when request_timeout stopped the query
  * in reload operation, need 1 parameter:
  *  indexpath
+ * cache operation shows the counters of the query cache
+ * stats operation shows the latency percentiles of every stage of a
+ * request, and its rate since the previous stats
  * eg. http://ip:8000/?opt=get&key=zhang&number=10
  *     http://ip:8000/?opt=reload&indexpath=/var/index
+ *     http://ip:8000/?opt=cache
+ *     http://ip:8000/?opt=stats
+ * the path /metrics exports the counters for Prometheus
  */
 static void process_http_cb(struct evhttp_request *req, void *arg)
 {
@@ -1030,6 +1464,13 @@ static void process_http_cb(struct evhttp_request *req, void *arg)
     evhttp_parse_query(decode_uri, &http_query);
     free(decode_uri);           /* This holds the content we're sending. */
     evb = evbuffer_new();   /*  URI Parameter  */
+    if (strcmp(decoded_path, "/metrics") == 0)
+    {
+        add_metrics(evb);
+        evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/plain; version=0.0.4");
+        evhttp_send_reply(req, HTTP_OK, "OK", evb);
+        goto done;
+    }
     http_input_opt = evhttp_find_header(&http_query, "opt"); /* Operation Type */
     http_input_key = evhttp_find_header(&http_query, "key"); /* key */
     http_input_number = evhttp_find_header(&http_query, "number"); /* max number of we want */
@@ -1054,37 +1495,38 @@ static void process_http_cb(struct evhttp_request *req, void *arg)
             number = atoi(http_input_number);
         }
         string key(http_input_key);
-        vector<string> vRes;
-        int ret = Get(key, vRes);
-        if (ret != 0 || vRes.size() == 0)
+        query_result res;
+        vector<result_item> &vRes = res.items;
+        uint64_t deadline = g_settings.request_timeout > 0 ? monotonic_msec() + g_settings.request_timeout : 0;
+        int ret = Get(key, number, res, deadline);
+        if (ret != 0)
         {
-            evhttp_send_error(req, HTTP_NOCONTENT, 0);
+            Release(res);
+            evhttp_send_error(req, HTTP_INTERNAL, 0);
             goto done;
         }
-        number = number > vRes.size() ? vRes.size() : number;
-        const char *trailing_slash = "";
-        if (!strlen(path) || path[strlen(path) - 1] != '/')
+        if (number <= 0 || number > vRes.size())
         {
-            trailing_slash = "/";
+            number = vRes.size();
         }
-        evbuffer_add_printf(evb, "<html>\n <head>\n"
-                            "  <title>%s</title>\n"
-                            "  <base href='%s%s'>\n"
-                            " </head>\n"
-                            " <body>\n"
-                            "  <h1>%s</h1>\n"
-                            "  <ul>\n",
-                            decoded_path, /* XXX html-escape this. */
-                            path, /* XXX html-escape this? */
-                            trailing_slash,
-                            decoded_path /* XXX html-escape this */);
+        evbuffer_add_printf(evb, "{\"key\":");
+        evbuffer_add_json_string(evb, key.c_str(), key.size());
+        if (res.partial)
+        {
+            evbuffer_add_printf(evb, ",\"partial\":true");
+        }
+        evbuffer_add_printf(evb, ",\"items\":[");
         for (int i = 0; i < number; i++)
         {
-            //evbuffer_add_printf(evb, "    <li><a href=\"%s\">%s</a>\n",
-            evbuffer_add_printf(evb, "    <li>%s</a>\n", vRes[i].c_str());/* XXX escape this */
+            if (i > 0)
+            {
+                evbuffer_add(evb, ",", 1);
+            }
+            evbuffer_add_json_string(evb, vRes[i].name, vRes[i].length);
         }
-        evbuffer_add_printf(evb, "</ul></body></html>\n");
-        evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/html");
+        Release(res);
+        evbuffer_add_printf(evb, "]}\n");
+        evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "application/json; charset=utf-8");
         evhttp_send_reply(req, HTTP_OK , "OK", evb);
     }
     else if (strcmp(http_input_opt, "reload") == 0)
@@ -1123,6 +1565,68 @@ static void process_http_cb(struct evhttp_request *req, void *arg)
             evhttp_send_reply(req, HTTP_OK, "Internal Error", evb);
         }
     }
+    else if (strcmp(http_input_opt, "cache") == 0)
+    {
+        cache_stats stats;
+        cache_get_stats(stats);
+        uint64_t lookups = stats.hits + stats.misses;
+        evbuffer_add_printf(evb, "<html>\n <head>\n"
+                            "  <title>%s</title>\n"
+                            " </head>\n"
+                            " <body>\n"
+                            "  <ul>\n",
+                            decoded_path /* XXX html-escape this */);
+        evbuffer_add_printf(evb, "    <li>hits: %" PRIu64 "\n", stats.hits);
+        evbuffer_add_printf(evb, "    <li>misses: %" PRIu64 "\n", stats.misses);
+        evbuffer_add_printf(evb, "    <li>hit_ratio: %.4f\n", lookups ? (double)stats.hits / lookups : 0.0);
+        evbuffer_add_printf(evb, "    <li>inserts: %" PRIu64 "\n", stats.inserts);
+        evbuffer_add_printf(evb, "    <li>evictions: %" PRIu64 "\n", stats.evictions);
+        evbuffer_add_printf(evb, "    <li>entries: %" PRIu64 "\n", stats.entries);
+        evbuffer_add_printf(evb, "    <li>bytes: %" PRIu64 " / %" PRIu64 "\n", stats.bytes, stats.max_bytes);
+        evbuffer_add_printf(evb, "</ul></body></html>\n");
+        evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/html");
+        evhttp_send_reply(req, HTTP_OK, "OK", evb);
+    }
+    else if (strcmp(http_input_opt, "threads") == 0)
+    {
+        evbuffer_add_printf(evb, "<html>\n <head>\n"
+                            "  <title>%s</title>\n"
+                            " </head>\n"
+                            " <body>\n"
+                            "  <ul>\n",
+                            decoded_path /* XXX html-escape this */);
+        for (int i = 0; i < g_settings.num_threads; i++)
+        {
+            thread_load load;
+            thread_get_load(i, &load);
+            evbuffer_add_printf(evb, "    <li>thread %d: connections: %d, requests: %" PRIu64 ", requests/s: %.1f\n",
+                                i, load.active_conns, load.requests, load.request_rate);
+        }
+        evbuffer_add_printf(evb, "</ul></body></html>\n");
+        evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/html");
+        evhttp_send_reply(req, HTTP_OK, "OK", evb);
+    }
+    else if (strcmp(http_input_opt, "stats") == 0)
+    {
+        stage_stats stats[STAGE_NUM];
+        stats_get(stats);
+        evbuffer_add_printf(evb, "<html>\n <head>\n"
+                            "  <title>%s</title>\n"
+                            " </head>\n"
+                            " <body>\n"
+                            "  <ul>\n",
+                            decoded_path /* XXX html-escape this */);
+        for (int i = 0; i < STAGE_NUM; i++)
+        {
+            evbuffer_add_printf(evb, "    <li>%s: count: %" PRIu64 ", per second: %.1f, mean: %.1fus, "
+                                "p50: %.1fus, p99: %.1fus, p999: %.1fus\n",
+                                stats[i].name, stats[i].count, stats[i].qps, stats[i].mean_us,
+                                stats[i].p50_us, stats[i].p99_us, stats[i].p999_us);
+        }
+        evbuffer_add_printf(evb, "</ul></body></html>\n");
+        evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/html");
+        evhttp_send_reply(req, HTTP_OK, "OK", evb);
+    }
     else
     {
         evhttp_send_error(req, HTTP_NOTFOUND, 0);
@@ -1141,8 +1645,16 @@ done:
     evbuffer_free(evb);
 }
 
-static int http_handler(unsigned short port, unsigned int timeout)
+static void *http_worker(void *arg)
+{
+    http_thread *me = (http_thread *)arg;
+    event_base_dispatch(me->base);
+    return NULL;
+}
+
+static int http_handler(unsigned short port, unsigned int timeout, int nthreads)
 {
+    struct evhttp_bound_socket *handle;
     struct sockaddr_storage ss;
     evutil_socket_t fd;
     ev_socklen_t socklen = sizeof(ss);
@@ -1154,28 +1666,61 @@ static int http_handler(unsigned short port, unsigned int timeout)
 
     log_debug(LOG_NOTICE, "begin to init http handler\n");
 
-    /* Create a new evhttp object to handle requests. */
-    http = evhttp_new(main_base);
-    if (!http)
+    if (nthreads < 1)
     {
-        log_debug(LOG_ERR, "couldn't create evhttp. Exiting.\n");
-        return -1;
+        nthreads = 1;
     }
-    /* set the http timeout */
-    evhttp_set_timeout(http , timeout);
-    /* only care about get request */
-    evhttp_set_allowed_methods(http , EVHTTP_REQ_GET);
-    /* We want to accept arbitrary requests, so we need to set a "generic" cb. We can also add callbacks for specific paths. */
-    evhttp_set_gencb(http, process_http_cb, NULL);
-    /* Now we tell the evhttp what port to listen on */
-    handle = evhttp_bind_socket_with_handle(http, "0.0.0.0", port);
-    if (!handle)
-    {
-        log_debug(LOG_ERR, "couldn't bind to port %d. Exiting.\n", (int)port);
+    http_threads = (http_thread *)calloc(nthreads, sizeof(http_thread));
+    if (!http_threads)
+    {
+        log_debug(LOG_ERR, "couldn't allocate the http threads. Exiting.\n");
         return -1;
     }
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        http_thread *me = &http_threads[i];
+        me->base = event_base_new();
+        /* Create a new evhttp object to handle requests. */
+        me->http = me->base ? evhttp_new(me->base) : NULL;
+        if (!me->http)
+        {
+            log_debug(LOG_ERR, "couldn't create evhttp. Exiting.\n");
+            return -1;
+        }
+        /* set the http timeout */
+        evhttp_set_timeout(me->http, timeout);
+        /* only care about get request */
+        evhttp_set_allowed_methods(me->http, EVHTTP_REQ_GET);
+        /* We want to accept arbitrary requests, so we need to set a "generic" cb. We can also add callbacks for specific paths. */
+        evhttp_set_gencb(me->http, process_http_cb, NULL);
+        if (i == 0)
+        {
+            /* Now we tell the evhttp what port to listen on */
+            handle = evhttp_bind_socket_with_handle(me->http, "0.0.0.0", port);
+            if (!handle)
+            {
+                log_debug(LOG_ERR, "couldn't bind to port %d. Exiting.\n", (int)port);
+                return -1;
+            }
+            fd = evhttp_bound_socket_get_fd(handle);
+        }
+        else if (evhttp_accept_socket(me->http, fd) != 0)
+        {
+            log_debug(LOG_ERR, "couldn't accept on the http socket. Exiting.\n");
+            return -1;
+        }
+    }
+    for (int i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&http_threads[i].thread_id, NULL, http_worker, &http_threads[i]) != 0)
+        {
+            log_debug(LOG_ERR, "couldn't create http thread. Exiting.\n");
+            return -1;
+        }
+    }
+
     /* Extract and display the address we're listening on. */
-    fd = evhttp_bound_socket_get_fd(handle);
     memset(&ss, 0, sizeof(ss));
     if (getsockname(fd, (struct sockaddr *)&ss, &socklen))
     {
@@ -1208,7 +1753,7 @@ static int http_handler(unsigned short port, unsigned int timeout)
         log_debug(LOG_ERR, "evutil_inet_ntop failed\n");
         return -1;
     }
-    log_debug(LOG_NOTICE, "finish init http handle, uri root %s\n", uri_root);
+    log_debug(LOG_NOTICE, "finish init http handle in %d threads, uri root %s\n", nthreads, uri_root);
     return 0;
 }
 
@@ -1392,7 +1937,8 @@ void init_server()
     output_settings(NULL);
 
     /* init log file */
-    if (log_init(GENERIC_FILE, g_settings.log_level, g_settings.log_path, NULL, 0) != 0)
+    int log_type = GENERIC_FILE | (g_settings.log_deferred ? LOG_DEFERRED : 0);
+    if (log_init(log_type, g_settings.log_level, g_settings.log_path, NULL, 0) != 0)
     {
         printf("error in parse log config\n");
         exit(-1);
@@ -1404,6 +1950,8 @@ void init_server()
         printf("error in load index file\n");
         exit(-1);
     }
+    cache_init((size_t)g_settings.cache_size << 20);
+    stats_init();
 
     do_privilege(g_settings.username);
 }
@@ -1461,6 +2009,12 @@ int main(int argc, char **argv)
     /* start up worker threads if MT mode */
     thread_init(g_settings.num_threads, main_base);
 
+    if (compute_init(g_settings.compute_threads) != 0)
+    {
+        log_debug(LOG_ERR, "failed to start %d compute threads\n", g_settings.compute_threads);
+        exit(EXIT_FAILURE);
+    }
+
     /* create unix mode sockets after dropping privileges */
     if (g_settings.socketpath != NULL)
     {
@@ -1475,14 +2029,35 @@ int main(int argc, char **argv)
 
     /* create the listening socket, bind it, and init */
     errno = 0;
-    if (g_settings.port && server_sockets(g_settings.port, tcp_transport, NULL))
+    if (g_settings.reuseport)
+    {
+        log_debug(LOG_ERR, "listen on TCP port %d in each of the %d workers\n", g_settings.port, g_settings.num_threads);
+    }
+    else if (g_settings.port && server_sockets(g_settings.port, tcp_transport, NULL))
     {
         log_debug(LOG_ERR, "failed to listen on TCP port %d, errno:%d\n", g_settings.port, error);
         exit(EX_OSERR);
     }
+    else
+    {
+        log_debug(LOG_ERR, "listen on TCP port %d successfully\n", g_settings.port);
+    }
 
-    log_debug(LOG_ERR, "listen on TCP port %d successfully\n", g_settings.port);
-    http_handler(g_settings.monitor_port, g_settings.monitor_timeout);
+    if (g_settings.udpport)
+    {
+        if (g_settings.num_threads_per_udp <= 0 || g_settings.num_threads_per_udp > g_settings.num_threads)
+        {
+            g_settings.num_threads_per_udp = g_settings.num_threads;
+        }
+        errno = 0;
+        if (server_sockets(g_settings.udpport, udp_transport, NULL))
+        {
+            log_debug(LOG_ERR, "failed to listen on UDP port %d, errno:%d\n", g_settings.udpport, error);
+            exit(EX_OSERR);
+        }
+        log_debug(LOG_ERR, "listen on UDP port %d in %d workers\n", g_settings.udpport, g_settings.num_threads_per_udp);
+    }
+    http_handler(g_settings.monitor_port, g_settings.monitor_timeout, g_settings.monitor_threads);
 
     /* Give the sockets a moment to open. I know this is dumb, but the error
      * is only an advisory.
@@ -1506,8 +2081,8 @@ int main(int argc, char **argv)
     remove_pidfile(g_settings.pidfile);
 
     Deinit_Index();
+    cache_deinit();
 
-    evhttp_free(http);
     event_base_free(main_base);
 
     return retval;
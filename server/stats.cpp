@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stats.h"
+#include "util.h"
+
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+/* values below SUB_BUCKETS have a bucket each, then SUB_BUCKETS for every bit */
+#define NBUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+
+typedef struct stage_hist
+{
+    uint64_t sum;
+    uint64_t buckets[NBUCKETS];
+} stage_hist;
+
+/* written by its thread only */
+typedef struct stats_table
+{
+    stage_hist stages[STAGE_NUM];
+} stats_table;
+
+static stats_table *stats_tables[MAX_THREAD_SLOTS];
+
+static const char *stage_names[STAGE_NUM] =
+{
+    "read", "pinyin", "trie", "filter", "serialize", "transmit",
+};
+
+/* what the previous stats_get saw, for the rates */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t stats_last_time = 0;
+static uint64_t stats_last_count[STAGE_NUM];
+
+static stats_table *stats_table_of_thread()
+{
+    static __thread stats_table *t_table = NULL;
+    if (t_table != NULL)
+    {
+        return t_table;
+    }
+
+    int slot = get_thread_slot();
+    if (slot < 0)
+    {
+        return NULL;
+    }
+    stats_table *table = (stats_table *)calloc(1, sizeof(stats_table));
+    if (table == NULL)
+    {
+        return NULL;
+    }
+    __atomic_store_n(&stats_tables[slot], table, __ATOMIC_RELEASE);
+    t_table = table;
+    return table;
+}
+
+static int bucket_of(uint64_t v)
+{
+    if (v < SUB_BUCKETS)
+    {
+        return v;
+    }
+    int bit = 63 - __builtin_clzll(v);
+    int sub = (v >> (bit - SUB_BITS)) - SUB_BUCKETS;
+    return (bit - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+/* the highest value of a bucket */
+static uint64_t bucket_top(int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    int bit = bucket / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t sub = bucket % SUB_BUCKETS + SUB_BUCKETS;
+    return ((sub + 1) << (bit - SUB_BITS)) - 1;
+}
+
+void stats_init()
+{
+    stats_last_time = stats_now();
+}
+
+uint64_t stats_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_record(int stage, uint64_t start)
+{
+    stats_table *table = stats_table_of_thread();
+    if (table == NULL)
+    {
+        return;
+    }
+    uint64_t ns = stats_now() - start;
+    stage_hist *h = &table->stages[stage];
+    uint64_t *bucket = &h->buckets[bucket_of(ns)];
+
+    //the only writer, the loads need no atomics
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + ns, __ATOMIC_RELAXED);
+}
+
+/* the value below which a fraction q of the samples are */
+static double percentile_us(const uint64_t *buckets, uint64_t count, double q)
+{
+    uint64_t rank = (uint64_t)(q * count);
+    uint64_t seen = 0;
+    for (int i = 0; i < NBUCKETS; i++)
+    {
+        seen += buckets[i];
+        if (seen > rank)
+        {
+            return bucket_top(i) / 1000.0;
+        }
+    }
+    return 0;
+}
+
+void stats_get(stage_stats *stats)
+{
+    static uint64_t buckets[NBUCKETS];
+
+    pthread_mutex_lock(&stats_lock);
+    uint64_t now = stats_now();
+    double elapsed = (now - stats_last_time) / 1e9;
+    stats_last_time = now;
+
+    for (int s = 0; s < STAGE_NUM; s++)
+    {
+        uint64_t count = 0, sum = 0;
+        memset(buckets, 0, sizeof(buckets));
+        for (int i = 0; i < MAX_THREAD_SLOTS; i++)
+        {
+            stats_table *table = __atomic_load_n(&stats_tables[i], __ATOMIC_ACQUIRE);
+            if (table == NULL)
+            {
+                continue;
+            }
+            stage_hist *h = &table->stages[s];
+            for (int b = 0; b < NBUCKETS; b++)
+            {
+                buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+            }
+            sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+        }
+        //the buckets are read one by one, the count is what they hold
+        for (int b = 0; b < NBUCKETS; b++)
+        {
+            count += buckets[b];
+        }
+
+        stage_stats *st = &stats[s];
+        st->name = stage_names[s];
+        st->count = count;
+        st->qps = (count - stats_last_count[s]) / elapsed;
+        st->mean_us = count ? sum / 1000.0 / count : 0;
+        st->p50_us = percentile_us(buckets, count, 0.5);
+        st->p99_us = percentile_us(buckets, count, 0.99);
+        st->p999_us = percentile_us(buckets, count, 0.999);
+        stats_last_count[s] = count;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
@@ -0,0 +1,47 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+
+/*
+ * Latency histograms of the stages of a request. Every thread records into
+ * tables of its own, without a lock, and the tables of all threads are
+ * summed when the monitor asks for them. A histogram is log-linear: the
+ * nanoseconds are bucketed by their highest bit and the 4 bits after it,
+ * so a percentile is off by at most 1/16.
+ */
+enum
+{
+    STAGE_READ,         /* parsing a request header, try_read_command */
+    STAGE_PINYIN,       /* readings of the chinese characters of a query */
+    STAGE_TRIE,         /* walking the trie for every reading, and the top-k of a ranked index */
+    STAGE_FILTER,       /* filter_result, only an index without ranks has it */
+    STAGE_SERIALIZE,    /* copying the items into the reply */
+    STAGE_TRANSMIT,     /* one sendmsg of a reply */
+    STAGE_NUM
+};
+
+typedef struct stage_stats
+{
+    const char *name;
+    uint64_t count;
+    double qps;         /* since the previous stats_get */
+    double mean_us;
+    double p50_us;
+    double p99_us;
+    double p999_us;
+} stage_stats;
+
+/* starts the clock of the first rates */
+void stats_init();
+
+/* nanoseconds of the monotonic clock */
+uint64_t stats_now();
+
+/* records the time of a stage which started at stats_now() start */
+void stats_record(int stage, uint64_t start);
+
+/* fills stats[STAGE_NUM] */
+void stats_get(stage_stats *stats);
+
+#endif
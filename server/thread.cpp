@@ -1,10 +1,11 @@
+#include <sys/eventfd.h>
+
 #include "thread.h"
 #include "conn.h"
 #include "network.h"
 #include "config.h"
 #include "log.h"
 
-#define ITEMS_PER_ALLOC 64
 
 /* Lock for cache operations (item_*, assoc_*) */
 pthread_mutex_t cache_lock;
@@ -14,15 +15,12 @@ pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
 
 pthread_mutex_t atomics_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/* Free list of CQ_ITEM structs */
-static CQ_ITEM *cqi_freelist;
-static pthread_mutex_t cqi_freelist_lock;
-
 static LIBEVENT_DISPATCHER_THREAD dispatcher_thread;
 
 /*
- * Each libevent instance has a wakeup pipe, which other threads
- * can use to signal that they've put a new connection on its queue.
+ * Each libevent instance has a wakeup eventfd, which the main thread
+ * uses to signal that it has put new connections on its queue, and the
+ * compute pool that it has finished a connection's request.
  */
 static LIBEVENT_THREAD *threads;
 
@@ -35,6 +33,13 @@ static pthread_cond_t init_cond;
 
 static void thread_libevent_process(int fd, short which, void *arg);
 
+extern void drive_machine(conn *c);
+
+/* how often the request rates of the workers are updated */
+#define LOAD_UPDATE_INTERVAL 1
+
+static struct event load_timer_event;
+
 static inline int mutex_lock(pthread_mutex_t *mutex)
 {
     while (pthread_mutex_trylock(mutex));
@@ -89,114 +94,39 @@ static void register_thread_initialized(void)
 }
 
 /*
- * Initializes a connection queue.
- */
-static void cq_init(CQ *cq)
-{
-    pthread_mutex_init(&cq->lock, NULL);
-    pthread_cond_init(&cq->cond, NULL);
-    cq->head = NULL;
-    cq->tail = NULL;
-}
-
-/*
- * Looks for an item on a connection queue, but doesn't block if there isn't
- * one.
- * Returns the item, or NULL if no item is available
+ * Adds an item to a connection queue, only called by the main thread.
+ * Returns -1 if the queue is full, 1 if it was empty, which is when the
+ * worker has to be woken up, and 0 otherwise.
  */
-static CQ_ITEM *cq_pop(CQ *cq)
+static int cq_push(CQ *cq, const CQ_ITEM *item)
 {
-    CQ_ITEM *item;
-
-    pthread_mutex_lock(&cq->lock);
-    item = cq->head;
-    if (NULL != item)
+    unsigned int tail = cq->tail;
+    if (tail - __atomic_load_n(&cq->head, __ATOMIC_ACQUIRE) >= NEW_CONN_RING_SIZE)
     {
-        cq->head = item->next;
-        if (NULL == cq->head)
-        {
-            cq->tail = NULL;
-        }
+        return -1;
     }
-    pthread_mutex_unlock(&cq->lock);
+    cq->items[tail % NEW_CONN_RING_SIZE] = *item;
+    __atomic_store_n(&cq->tail, tail + 1, __ATOMIC_SEQ_CST);
 
-    return item;
+    //the worker publishes head before it looks at tail again, so either it
+    //sees this item or we see that it had taken every item before it
+    return __atomic_load_n(&cq->head, __ATOMIC_SEQ_CST) == tail ? 1 : 0;
 }
 
 /*
- * Adds an item to a connection queue.
+ * Takes the next item of a connection queue, only called by its worker.
+ * Returns false if it is empty.
  */
-static void cq_push(CQ *cq, CQ_ITEM *item)
+static bool cq_pop(CQ *cq, CQ_ITEM *item)
 {
-    item->next = NULL;
-
-    pthread_mutex_lock(&cq->lock);
-    if (NULL == cq->tail)
+    unsigned int head = cq->head;
+    if (head == __atomic_load_n(&cq->tail, __ATOMIC_SEQ_CST))
     {
-        cq->head = item;
+        return false;
     }
-    else
-    {
-        cq->tail->next = item;
-    }
-    cq->tail = item;
-    pthread_cond_signal(&cq->cond);
-    pthread_mutex_unlock(&cq->lock);
-}
-
-/*
- * Returns a fresh connection queue item.
- */
-static CQ_ITEM *cqi_new(void)
-{
-    CQ_ITEM *item = NULL;
-    pthread_mutex_lock(&cqi_freelist_lock);
-    if (cqi_freelist)
-    {
-        item = cqi_freelist;
-        cqi_freelist = item->next;
-    }
-    pthread_mutex_unlock(&cqi_freelist_lock);
-
-    if (NULL == item)
-    {
-        int i;
-
-        /* Allocate a bunch of items at once to reduce fragmentation */
-        item = (CQ_ITEM *)malloc(sizeof(CQ_ITEM) * ITEMS_PER_ALLOC);
-        if (NULL == item)
-        {
-            return NULL;
-        }
-
-        /*
-         * Link together all the new items except the first one
-         * (which we'll return to the caller) for placement on
-         * the freelist.
-         */
-        for (i = 2; i < ITEMS_PER_ALLOC; i++)
-        {
-            item[i - 1].next = &item[i];
-        }
-
-        pthread_mutex_lock(&cqi_freelist_lock);
-        item[ITEMS_PER_ALLOC - 1].next = cqi_freelist;
-        cqi_freelist = &item[1];
-        pthread_mutex_unlock(&cqi_freelist_lock);
-    }
-
-    return item;
-}
-
-/*
- * Frees a connection queue item (adds it to the freelist.)
- */
-static void cqi_free(CQ_ITEM *item)
-{
-    pthread_mutex_lock(&cqi_freelist_lock);
-    item->next = cqi_freelist;
-    cqi_freelist = item;
-    pthread_mutex_unlock(&cqi_freelist_lock);
+    *item = cq->items[head % NEW_CONN_RING_SIZE];
+    __atomic_store_n(&cq->head, head + 1, __ATOMIC_SEQ_CST);
+    return true;
 }
 
 /*
@@ -242,23 +172,25 @@ static void setup_thread(LIBEVENT_THREAD *me)
     }
 
     /* Listen for notifications from other threads */
-    event_set(&me->notify_event, me->notify_receive_fd,
+    event_set(&me->notify_event, me->notify_fd,
               EV_READ | EV_PERSIST, thread_libevent_process, me);
     event_base_set(me->base, &me->notify_event);
 
     if (event_add(&me->notify_event, 0) == -1)
     {
-        log_debug(LOG_ERR, "Can't monitor libevent notify pipe\n");
+        log_debug(LOG_ERR, "Can't monitor libevent notify eventfd\n");
         exit(1);
     }
 
-    me->new_conn_queue = (conn_queue *)malloc(sizeof(struct conn_queue));
+    me->new_conn_queue = (CQ *)calloc(1, sizeof(CQ));
     if (me->new_conn_queue == NULL)
     {
         log_debug(LOG_ERR, "Failed to allocate memory for connection queue, error:%s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
-    cq_init(me->new_conn_queue);
+
+    pthread_mutex_init(&me->done_lock, NULL);
+    me->done_conns = NULL;
 }
 
 /*
@@ -279,81 +211,210 @@ static void *worker_libevent(void *arg)
 }
 
 /*
- * Processes an incoming "handle a new connection" item. This is called when
- * input arrives on the libevent wakeup pipe.
+ * Processes the incoming "handle a new connection" items. This is called
+ * when the libevent wakeup eventfd is signaled, and takes every item queued
+ * since.
  */
 static void thread_libevent_process(int fd, short which, void *arg)
 {
     LIBEVENT_THREAD *me = (LIBEVENT_THREAD *)arg;
-    CQ_ITEM *item;
-    char buf[1];
+    CQ_ITEM item;
+    uint64_t count;
 
-    if (read(fd, buf, 1) != 1)
-        if (g_settings.verbose > 0)
+    /* reset the eventfd before looking at the queue, see cq_push() */
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+        if (g_settings.verbose > 0 && errno != EAGAIN)
         {
-            log_debug(LOG_ERR, "Can't read from libevent pipe\n");
+            log_debug(LOG_ERR, "Can't read from libevent eventfd\n");
         }
 
-    if (buf[0] != 'c')
+    while (cq_pop(me->new_conn_queue, &item))
     {
-        return;
-    }
-
-    item = cq_pop(me->new_conn_queue);
-
-    if (NULL != item)
-    {
-        conn *c = conn_new(item->sfd, item->init_state, item->event_flags,
-                           item->read_buffer_size, item->transport, me->base);
+        conn *c = conn_new(item.sfd, item.init_state, item.event_flags,
+                           item.read_buffer_size, item.transport, me->base);
         if (c == NULL)
         {
             if (g_settings.verbose > 0)
             {
                 log_debug(LOG_ERR, "Can't listen for events on fd %d\n",
-                          item->sfd);
+                          item.sfd);
+            }
+            close(item.sfd);
+            if (!IS_UDP(item.transport))
+            {
+                __sync_sub_and_fetch(&me->active_conns, 1);
             }
-            close(item->sfd);
         }
         else
         {
             c->thread = me;
         }
-        cqi_free(item);
     }
 
+    pthread_mutex_lock(&me->done_lock);
+    conn *done = me->done_conns;
+    me->done_conns = NULL;
+    pthread_mutex_unlock(&me->done_lock);
+
+    //oldest first
+    conn *list = NULL;
+    while (done != NULL)
+    {
+        conn *next = done->next;
+        done->next = list;
+        list = done;
+        done = next;
+    }
+    while (list != NULL)
+    {
+        conn *next = list->next;
+        list->next = NULL;
+        drive_machine(list);
+        list = next;
+    }
 }
 
-/* Which thread we assigned a connection to most recently. */
-static int last_thread = -1;
+void thread_post_done(LIBEVENT_THREAD *me, conn *c)
+{
+    pthread_mutex_lock(&me->done_lock);
+    bool wake = me->done_conns == NULL;
+    c->next = me->done_conns;
+    me->done_conns = c;
+    pthread_mutex_unlock(&me->done_lock);
+
+    uint64_t one = 1;
+    if (wake && write(me->notify_fd, &one, sizeof(one)) != sizeof(one))
+    {
+        log_debug(LOG_ERR, "Writing to thread notify eventfd, error:%s\n", strerror(errno));
+    }
+}
+
+/*
+ * Updates the request rates of the workers, on the main thread.
+ */
+static void load_timer_handler(const int fd, const short which, void *arg)
+{
+    struct timeval t = {LOAD_UPDATE_INTERVAL, 0};
+
+    for (int i = 0; i < g_settings.num_threads; i++)
+    {
+        LIBEVENT_THREAD *thread = threads + i;
+        uint64_t requests = __atomic_load_n(&thread->requests, __ATOMIC_RELAXED);
+        double rate = (double)(requests - thread->last_requests) / LOAD_UPDATE_INTERVAL;
+        thread->last_requests = requests;
+        thread->request_rate = (thread->request_rate + rate) / 2;
+    }
+    evtimer_add(&load_timer_event, &t);
+}
+
+/*
+ * The expected request rate of a thread with one more connection: what it
+ * serves now, and for each of its connections the average rate of a
+ * connection over all the threads.
+ */
+static double thread_load_score(const LIBEVENT_THREAD *thread, double conn_rate)
+{
+    return thread->request_rate + (thread->active_conns + 1) * conn_rate;
+}
+
+static unsigned int dispatch_seed = 1;
+
+/*
+ * Queues a new connection on the worker tid, or on the next one whose
+ * queue is not full, a full queue means its worker is stuck.
+ */
+static void queue_conn_new(int tid, const CQ_ITEM *item)
+{
+    int nthreads = g_settings.num_threads;
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        LIBEVENT_THREAD *thread = threads + (tid + i) % nthreads;
+        //a udp socket is not a client, keep it out of the connection count
+        int counted = !IS_UDP(item->transport);
+        __sync_add_and_fetch(&thread->active_conns, counted);
+        int ret = cq_push(thread->new_conn_queue, item);
+        if (ret < 0)
+        {
+            __sync_sub_and_fetch(&thread->active_conns, counted);
+            continue;
+        }
+
+        uint64_t one = 1;
+        if (ret > 0 && write(thread->notify_fd, &one, sizeof(one)) != sizeof(one))
+        {
+            log_debug(LOG_ERR, "Writing to thread notify eventfd, error:%s\n", strerror(errno));
+        }
+        return;
+    }
+
+    log_debug(LOG_ERR, "the connection queues of all workers are full, closing fd %d\n", item->sfd);
+    close(item->sfd);
+}
 
 /*
  * Dispatches a new connection to another thread. This is only ever called
  * from the main thread, either during initialization (for UDP) or because
  * of an incoming connection.
+ *
+ * Of two workers picked at random, the connection goes to the less loaded
+ * one, which spreads the load about as well as looking at all of them.
  */
 void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags,
                        int read_buffer_size, enum network_transport transport)
 {
-    CQ_ITEM *item = cqi_new();
-    char buf[1];
-    int tid = (last_thread + 1) % g_settings.num_threads;
+    int nthreads = g_settings.num_threads;
+    int tid = rand_r(&dispatch_seed) % nthreads;
 
-    LIBEVENT_THREAD *thread = threads + tid;
-
-    last_thread = tid;
+    if (nthreads > 1)
+    {
+        int other = (tid + 1 + rand_r(&dispatch_seed) % (nthreads - 1)) % nthreads;
+        double rate = 0;
+        int conns = 0;
+        for (int i = 0; i < nthreads; i++)
+        {
+            rate += threads[i].request_rate;
+            conns += threads[i].active_conns;
+        }
+        double conn_rate = conns > 0 ? rate / conns : 0;
+        if (conn_rate < 1)
+        {
+            conn_rate = 1;
+        }
+        if (thread_load_score(threads + other, conn_rate) < thread_load_score(threads + tid, conn_rate))
+        {
+            tid = other;
+        }
+    }
 
-    item->sfd = sfd;
-    item->init_state = init_state;
-    item->event_flags = event_flags;
-    item->read_buffer_size = read_buffer_size;
-    item->transport = transport;
+    dispatch_conn_to(tid, sfd, init_state, event_flags, read_buffer_size, transport);
+}
 
-    cq_push(thread->new_conn_queue, item);
+void dispatch_conn_to(int tid, int sfd, enum conn_states init_state, int event_flags,
+                      int read_buffer_size, enum network_transport transport)
+{
+    CQ_ITEM item;
+    item.sfd = sfd;
+    item.init_state = init_state;
+    item.event_flags = event_flags;
+    item.read_buffer_size = read_buffer_size;
+    item.transport = transport;
+
+    queue_conn_new(tid % g_settings.num_threads, &item);
+}
 
-    buf[0] = 'c';
-    if (write(thread->notify_send_fd, buf, 1) != 1)
+void thread_get_load(int i, thread_load *load)
+{
+    LIBEVENT_THREAD *thread = threads + i;
+    load->active_conns = __atomic_load_n(&thread->active_conns, __ATOMIC_RELAXED);
+    load->requests = __atomic_load_n(&thread->requests, __ATOMIC_RELAXED);
+    load->request_rate = thread->request_rate;
+    load->bytes_read = __atomic_load_n(&thread->bytes_read, __ATOMIC_RELAXED);
+    load->bytes_written = __atomic_load_n(&thread->bytes_written, __ATOMIC_RELAXED);
+    load->results = __atomic_load_n(&thread->results, __ATOMIC_RELAXED);
+    for (int s = 0; s < 256; s++)
     {
-        log_debug(LOG_ERR, "Writing to thread notify pipe, error:%s\n", strerror(errno));
+        load->responses[s] = __atomic_load_n(&thread->responses[s], __ATOMIC_RELAXED);
     }
 }
 
@@ -380,9 +441,6 @@ void thread_init(int nthreads, struct event_base *main_base)
     pthread_mutex_init(&init_lock, NULL);
     pthread_cond_init(&init_cond, NULL);
 
-    pthread_mutex_init(&cqi_freelist_lock, NULL);
-    cqi_freelist = NULL;
-
     threads = (LIBEVENT_THREAD *)calloc(nthreads, sizeof(LIBEVENT_THREAD));
     if (! threads)
     {
@@ -393,20 +451,31 @@ void thread_init(int nthreads, struct event_base *main_base)
     dispatcher_thread.base = main_base;
     dispatcher_thread.thread_id = pthread_self();
 
+    struct timeval t = {LOAD_UPDATE_INTERVAL, 0};
+    evtimer_set(&load_timer_event, load_timer_handler, NULL);
+    event_base_set(main_base, &load_timer_event);
+    evtimer_add(&load_timer_event, &t);
+
     for (i = 0; i < nthreads; i++)
     {
-        int fds[2];
-        if (pipe(fds))
+        threads[i].index = i;
+        threads[i].notify_fd = eventfd(0, EFD_NONBLOCK);
+        if (threads[i].notify_fd < 0)
         {
-            log_debug(LOG_ERR, "Can't create notify pipe, error:%s\n", strerror(errno));
+            log_debug(LOG_ERR, "Can't create notify eventfd, error:%s\n", strerror(errno));
             exit(1);
         }
 
-        threads[i].notify_receive_fd = fds[0];
-        threads[i].notify_send_fd = fds[1];
-
         setup_thread(&threads[i]);
-        /* Reserve three fds for the libevent base, and two for the pipe */
+        /* Reserve three fds for the libevent base, and one for the eventfd */
+
+        /* the listening socket is added to the base before its loop runs */
+        if (g_settings.reuseport && g_settings.port &&
+            server_sockets_reuseport(g_settings.port, &threads[i]) != 0)
+        {
+            log_debug(LOG_ERR, "failed to listen on TCP port %d with SO_REUSEPORT\n", g_settings.port);
+            exit(EX_OSERR);
+        }
     }
 
     /* Create threads after we've done all the libevent setup. */
@@ -14,29 +14,65 @@ struct conn_queue_item
     int               event_flags;
     int               read_buffer_size;
     enum network_transport     transport;
-    CQ_ITEM          *next;
 };
 
-/* A connection queue. */
-typedef struct conn_queue CQ;
-struct conn_queue
+#define NEW_CONN_RING_SIZE 1024
+
+/*
+ * A connection queue: a ring with a single producer, the main thread, and
+ * a single consumer, the worker. head and tail only grow, the slot of a
+ * position is position % NEW_CONN_RING_SIZE.
+ */
+typedef struct conn_ring CQ;
+struct conn_ring
 {
-    CQ_ITEM *head;
-    CQ_ITEM *tail;
-    pthread_mutex_t lock;
-    pthread_cond_t  cond;
+    CQ_ITEM items[NEW_CONN_RING_SIZE];
+    unsigned int head __attribute__((aligned(64)));    /* next item to pop, written by the worker */
+    unsigned int tail __attribute__((aligned(64)));    /* next slot to push, written by the main thread */
 };
 
 typedef struct
 {
     pthread_t thread_id;        /* unique ID of this thread */
+    int index;                  /* position among the workers */
     struct event_base *base;    /* libevent handle this thread uses */
-    struct event notify_event;  /* listen event for notify pipe */
-    int notify_receive_fd;      /* receiving end of notify pipe */
-    int notify_send_fd;         /* sending end of notify pipe */
-    struct conn_queue *new_conn_queue; /* queue of new connections to handle */
+    struct event notify_event;  /* listen event for notify_fd */
+    int notify_fd;              /* eventfd signaled when new_conn_queue gets items */
+    struct conn_ring *new_conn_queue; /* queue of new connections to handle */
+
+    pthread_mutex_t done_lock;
+    struct conn *done_conns;    /* connections the compute pool has built a reply for, newest first */
+
+    /* load of the thread, see dispatch_conn_new() */
+    int active_conns;           /* connections dispatched to or accepted by it */
+    uint64_t requests;          /* requests served, only written by the thread */
+    uint64_t last_requests;     /* requests at the last rate update */
+    double request_rate;        /* requests per second, smoothed */
+
+    /* counters for the monitor */
+    uint64_t bytes_read;        /* only written by the thread, see thread_count() */
+    uint64_t bytes_written;     /* only written by the thread */
+    uint64_t results;           /* items replied, the compute pool adds to it too */
+    uint64_t responses[256];    /* replies by response_status, the same */
 } LIBEVENT_THREAD;
 
+typedef struct thread_load
+{
+    int active_conns;
+    uint64_t requests;
+    double request_rate;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t results;
+    uint64_t responses[256];
+} thread_load;
+
+/* adds n to a counter that only the calling thread writes */
+static inline void thread_count(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
 typedef struct
 {
     pthread_t thread_id;        /* unique ID of this thread */
@@ -45,7 +81,18 @@ typedef struct
 
 void thread_init(int nthreads, struct event_base *main_base);
 void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags, int read_buffer_size, enum network_transport transport);
+/* the same, to the worker tid */
+void dispatch_conn_to(int tid, int sfd, enum conn_states init_state, int event_flags, int read_buffer_size, enum network_transport transport);
 int is_listen_thread(void);
+
+/* the load of the worker i, for the monitor */
+void thread_get_load(int i, thread_load *load);
 void accept_new_conns(const bool do_accept);
 
+/*
+ * Hands a connection back to its worker once the compute pool is done with
+ * it, the worker then drives it on from the state it was left in.
+ */
+void thread_post_done(LIBEVENT_THREAD *me, struct conn *c);
+
 #endif
@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include "util.h"
 
@@ -504,6 +505,34 @@ int mysleep_sec(unsigned int second)
     return 0;
 }
 
+uint64_t monotonic_msec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int g_thread_slots = 0;
+static __thread int t_thread_slot = -1;
+
+int get_thread_slot()
+{
+    if (t_thread_slot < 0)
+    {
+        if (g_thread_slots >= MAX_THREAD_SLOTS)
+        {
+            return -1;
+        }
+        int slot = __sync_fetch_and_add(&g_thread_slots, 1);
+        if (slot >= MAX_THREAD_SLOTS)
+        {
+            return -1;
+        }
+        t_thread_slot = slot;
+    }
+    return t_thread_slot;
+}
+
 int mysleep_millisec(unsigned int millisecond)
 {
     struct timeval t_timeval;